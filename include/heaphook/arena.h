@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+
+// Arenas exported by the preloaded libraries.
+//
+// An arena hands out memory by bumping a pointer through chunks allocated from the heaphook
+// allocator, so its memory is accounted for like any other allocation. Blocks are never freed
+// one by one: heaphook_arena_reset releases all of them at once in constant time, keeping the
+// chunks for reuse, and heaphook_arena_destroy returns the chunks to the allocator.
+//
+// An arena is not thread-safe; use one per thread (e.g. per callback).
+//
+// The functions are declared weak, so that a program can be linked without heaphook and check
+// whether a preloaded library provides them (heaphook_arena_create != NULL).
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct heaphook_arena heaphook_arena_t;
+
+// creates an arena which allocates chunks of chunk_size bytes (64KB if 0).
+// returns NULL if the allocation of the arena fails.
+__attribute__((weak))
+heaphook_arena_t * heaphook_arena_create(size_t chunk_size);
+
+// allocates size bytes aligned to alignment (alignof(max_align_t) if 0) from arena.
+// a request larger than the chunk size gets a chunk of its own.
+// returns NULL if alignment is not a power of 2 or the allocation of a chunk fails.
+__attribute__((weak))
+void * heaphook_arena_alloc(heaphook_arena_t * arena, size_t size, size_t alignment);
+
+// releases every block allocated from arena. the chunks are kept for the next allocations.
+__attribute__((weak))
+void heaphook_arena_reset(heaphook_arena_t * arena);
+
+// returns the chunks of arena to the allocator and destroys it. arena may be NULL.
+__attribute__((weak))
+void heaphook_arena_destroy(heaphook_arena_t * arena);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+#include "heaphook/arena.h"
+
+namespace heaphook
+{
+
+// std::pmr::memory_resource on top of a heaphook arena, e.g.
+//
+// heaphook::ArenaResource scratch;
+// void callback(const Message & msg) {
+//   std::pmr::vector<int> values(&scratch);
+//   ...
+//   scratch.reset(); // after values is destroyed
+// }
+//
+// deallocate is a no-op, and reset releases everything allocated so far.
+// without a preloaded heaphook library, it falls back to std::pmr::monotonic_buffer_resource
+// on top of upstream.
+class ArenaResource : public std::pmr::memory_resource
+{
+public:
+  explicit ArenaResource(
+    size_t chunk_size = 0,
+    std::pmr::memory_resource * upstream = std::pmr::get_default_resource())
+  : arena_(heaphook_arena_create ? heaphook_arena_create(chunk_size) : nullptr),
+    fallback_(chunk_size > 0 ? chunk_size : 64 * 1024, upstream)
+  {
+  }
+
+  ArenaResource(const ArenaResource &) = delete;
+  ArenaResource & operator=(const ArenaResource &) = delete;
+
+  ~ArenaResource() override
+  {
+    if (arena_ != nullptr) {
+      heaphook_arena_destroy(arena_);
+    }
+  }
+
+  // whether the memory comes from the heaphook arena
+  bool uses_arena() const noexcept
+  {
+    return arena_ != nullptr;
+  }
+
+  void reset() noexcept
+  {
+    if (arena_ != nullptr) {
+      heaphook_arena_reset(arena_);
+    } else {
+      fallback_.release();
+    }
+  }
+
+private:
+  void * do_allocate(size_t bytes, size_t alignment) override
+  {
+    if (arena_ == nullptr) {
+      return fallback_.allocate(bytes, alignment);
+    }
+    void * ptr = heaphook_arena_alloc(arena_, bytes, alignment);
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    return ptr;
+  }
+
+  void do_deallocate(void *, size_t, size_t) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override
+  {
+    return this == &other;
+  }
+
+  heaphook_arena_t * arena_;
+  std::pmr::monotonic_buffer_resource fallback_;
+};
+
+} // namespace heaphook
@@ -1,3 +1,5 @@
+#pragma once
+
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
@@ -14,9 +16,35 @@ static constexpr bool HeapTraceEnabled = true;
 static constexpr bool HeapTraceEnabled = false;
 #endif
 
+// when TRACE_BACKTRACE is defined in addition to TRACE,
+// every allocation in the heap trace log carries the id of its call stack.
+#if defined(TRACE) && defined(TRACE_BACKTRACE)
+static constexpr bool HeapTraceBacktraceEnabled = true;
+#else
+static constexpr bool HeapTraceBacktraceEnabled = false;
+#endif
+
 namespace heaphook
 {
 
+// memory usage of an allocator, reported through mallinfo2, mallinfo, malloc_stats and malloc_info.
+struct AllocatorStats
+{
+  size_t mapped_bytes = 0; // obtained from the OS
+  size_t num_added_areas = 0; // areas obtained after startup
+  size_t added_area_bytes = 0; // included in mapped_bytes
+  size_t used_bytes = 0; // usable bytes of the blocks in use
+  size_t free_bytes = 0;
+  size_t peak_used_bytes = 0;
+  size_t num_used_blocks = 0;
+  size_t block_overhead = 0; // bytes of metadata per block
+};
+
+// returns the address the hooked allocation function (malloc, calloc, realloc, ...) last called on
+// this thread returns to, i.e. its call site in the application, or nullptr before any.
+// allocators may use it to place the blocks of a call site together.
+const void * current_callsite();
+
 // this class designed with singlton design pattern.
 class GlobalAllocator
 {
@@ -60,6 +88,12 @@ public:
   // ptr is not nullptr and must be the value returned by those functions.
   void dealloc(void * ptr);
 
+  // this member function is dealloc, when the caller knows the size and the alignment
+  // ptr was allocated with, e.g. sized operator delete.
+  //
+  // size is the size passed to the allocation function, and align is 1 if none was specified.
+  void dealloc_sized(void * ptr, size_t size, size_t align);
+
   // this function returns the size of the memory area pointed to by ptr.
   size_t get_block_size(void * ptr);
 
@@ -81,11 +115,36 @@ public:
   [[nodiscard]]
   void * realloc(void * ptr, size_t new_size);
 
+  // this function is realloc, when the caller knows the size ptr was last allocated
+  // or resized to.
+  //
+  // old_size > 0
+  // new_size > 0
+  // ptr != nullptr
+  //
+  // if allocation fails, returns nullptr.
+  [[nodiscard]]
+  void * realloc_sized(void * ptr, size_t old_size, size_t new_size);
+
+  // this function returns free memory to the OS, keeping about pad bytes of it.
+  //
+  // returns 1 if some memory was released, 0 otherwise.
+  int trim(size_t pad);
+
+  // this function fills stats with the current memory usage.
+  // detailed is true for the reports a user reads (malloc_stats, malloc_info), which may take longer.
+  //
+  // returns false if the allocator does not keep statistics.
+  bool get_stats(AllocatorStats & stats, bool detailed);
+
 private:
   virtual void * do_alloc(size_t, size_t) = 0;
 
   virtual void do_dealloc(void *) = 0;
 
+  // this member function has default implementation
+  virtual void do_dealloc_sized(void * ptr, size_t size, size_t align);
+
   virtual size_t do_get_block_size(void *) = 0;
 
   // this member function has default implementation
@@ -93,6 +152,15 @@ private:
 
   // this member function has default implementation
   virtual void * do_realloc(void * ptr, size_t new_size);
+
+  // this member function has default implementation
+  virtual void * do_realloc_sized(void * ptr, size_t old_size, size_t new_size);
+
+  // this member function has default implementation
+  virtual int do_trim(size_t pad);
+
+  // this member function has default implementation
+  virtual bool do_get_stats(AllocatorStats & stats, bool detailed);
 };
 
 } // namespace heaphook
@@ -12,6 +12,7 @@
 #include <mutex>
 #include <condition_variable>
 
+#include "heaphook.hpp"
 #include "utils.hpp"
 
 namespace heaphook
@@ -23,6 +24,7 @@ struct AllocInfo
   size_t align;
   void * retval;
   size_t processing_time;
+  size_t stack_id;
 };
 
 struct DeallocInfo
@@ -43,6 +45,7 @@ struct AllocZeroedInfo
   size_t bytes;
   void * retval;
   size_t processing_time;
+  size_t stack_id;
 };
 
 struct ReallocInfo
@@ -51,6 +54,7 @@ struct ReallocInfo
   size_t new_size;
   void * retval;
   size_t processing_time;
+  size_t stack_id;
 };
 
 // this class designed with singlton design pattern.
@@ -83,9 +87,15 @@ public:
   {
     // since log_line_buf_ is a thread-local member variable,
     // no mutex is required.
-    format_as_csv_entry(
-      log_line_buf_, "alloc", info.bytes, info.align, info.retval,
-      info.processing_time);
+    if constexpr (HeapTraceBacktraceEnabled) {
+      format_as_csv_entry(
+        log_line_buf_, "alloc", info.bytes, info.align, info.retval,
+        info.processing_time, info.stack_id);
+    } else {
+      format_as_csv_entry(
+        log_line_buf_, "alloc", info.bytes, info.align, info.retval,
+        info.processing_time);
+    }
     write_log_line();
   }
 
@@ -105,17 +115,29 @@ public:
 
   void write_log(AllocZeroedInfo & info)
   {
-    format_as_csv_entry(
-      log_line_buf_, "alloc_zeroed", info.bytes, info.retval,
-      info.processing_time);
+    if constexpr (HeapTraceBacktraceEnabled) {
+      format_as_csv_entry(
+        log_line_buf_, "alloc_zeroed", info.bytes, info.retval,
+        info.processing_time, info.stack_id);
+    } else {
+      format_as_csv_entry(
+        log_line_buf_, "alloc_zeroed", info.bytes, info.retval,
+        info.processing_time);
+    }
     write_log_line();
   }
 
   void write_log(ReallocInfo & info)
   {
-    format_as_csv_entry(
-      log_line_buf_, "realloc", info.ptr, info.new_size, info.retval,
-      info.processing_time);
+    if constexpr (HeapTraceBacktraceEnabled) {
+      format_as_csv_entry(
+        log_line_buf_, "realloc", info.ptr, info.new_size, info.retval,
+        info.processing_time, info.stack_id);
+    } else {
+      format_as_csv_entry(
+        log_line_buf_, "realloc", info.ptr, info.new_size, info.retval,
+        info.processing_time);
+    }
     write_log_line();
   }
 
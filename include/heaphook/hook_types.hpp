@@ -1,4 +1,8 @@
+#include <malloc.h>
+#include <pthread.h>
+
 #include <cstddef>
+#include <cstdio>
 
 // hook function type
 using malloc_type = void * (*)(size_t);
@@ -13,3 +17,13 @@ using valloc_type = void * (*)(size_t);
 using pvalloc_type = void * (*)(size_t);
 
 using malloc_usable_size_type = size_t (*)(void *);
+using malloc_trim_type = int (*)(size_t);
+
+using mallinfo_type = struct mallinfo (*)();
+#ifdef HAVE_MALLINFO2
+using mallinfo2_type = struct mallinfo2 (*)();
+#endif
+using malloc_stats_type = void (*)();
+using malloc_info_type = int (*)(int, FILE *);
+
+using pthread_setname_np_type = int (*)(pthread_t, const char *);
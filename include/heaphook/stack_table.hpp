@@ -0,0 +1,79 @@
+#pragma once
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <mutex>
+
+#include "utils.hpp"
+
+namespace heaphook
+{
+
+// this class deduplicates the call stacks of allocation requests and assigns each of them
+// a stack id, which is written into the heap trace log.
+// every new stack is appended to ./heaplog_<pid>.stacks in the following form,
+// so the log can be joined with its callers afterwards.
+//
+// stack <id>
+// <symbolized frame>
+// ...
+// <empty line>
+//
+// the id 0 means that the stack is unknown (nested capture or full table).
+//
+// this class designed with singlton design pattern.
+class StackTable
+{
+  static constexpr int kMaxFrames = 32;
+  static constexpr size_t kDefaultMaxStacks = 1 << 18;
+  static constexpr size_t kMinMaxStacks = 1;
+  static constexpr size_t kMaxMaxStacks = 1ul << 30;
+
+  struct Entry
+  {
+    uint64_t hash;
+    int num_frames;
+    void * frames[kMaxFrames];
+  };
+
+  char stacks_file_name_[0x400];
+  int stacks_file_fd_;
+
+  // entries_[id - 1] holds the stack whose id is id.
+  // index_ is an open addressing hash table of ids, which has twice the slots of entries_.
+  Entry * entries_;
+  uint32_t * index_;
+  size_t max_stacks_;
+  size_t num_stacks_;
+
+  thread_local static bool in_capture_;
+
+  std::mutex mtx_;
+
+protected:
+  StackTable();
+
+public:
+  StackTable(const StackTable &) = delete;
+  void operator=(const StackTable &) = delete;
+  StackTable(StackTable &&) = delete;
+  void operator=(StackTable &&) = delete;
+
+  static StackTable & getInstance()
+  {
+    static StackTable table;
+    return table;
+  }
+
+  // captures the call stack of the caller and returns its stack id.
+  // this function does not allocate heap memory.
+  size_t intern_current_stack();
+
+private:
+  size_t intern(const void * const * frames, int num_frames);
+};
+
+} // namespace heaphook
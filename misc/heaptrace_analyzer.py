@@ -1,17 +1,18 @@
 #!/usr/bin/python3
+import argparse
 import os
-import sys
 
 import matplotlib.pyplot as plt
 
 
 class AllocInfo:
 
-    def __init__(self, size, align, addr, time):
+    def __init__(self, size, align, addr, time, stack_id=0):
         self.size = size
         self.align = align
         self.addr = addr
         self.time = time
+        self.stack_id = stack_id
 
     def __str__(self):
         return f'alloc({self.size}, {self.align}) -> {hex(self.addr)} [ {self.time} ns ]'
@@ -29,10 +30,11 @@ class DeallocInfo:
 
 class AllocZeroedInfo:
 
-    def __init__(self, size, addr, time):
+    def __init__(self, size, addr, time, stack_id=0):
         self.size = size
         self.addr = addr
         self.time = time
+        self.stack_id = stack_id
 
     def __str__(self):
         return f'alloc_zeroed({self.size}) -> {hex(self.addr)} [ {self.time} ns ]'
@@ -40,11 +42,12 @@ class AllocZeroedInfo:
 
 class ReallocInfo:
 
-    def __init__(self, old_addr, new_size, new_addr, time):
+    def __init__(self, old_addr, new_size, new_addr, time, stack_id=0):
         self.old_addr = old_addr
         self.new_size = new_size
         self.new_addr = new_addr
         self.time = time
+        self.stack_id = stack_id
 
     def __str__(self):
         return (
@@ -64,10 +67,32 @@ class GetBlockSizeInfo:
         return f'get_block_size({hex(self.addr)}) -> {self.size} [ {self.time} ns ]'
 
 
+def load_stack_table(stacks_file_name):
+    """Parse heaplog_<pid>.stacks written by libpreloaded_heaptrack_backtrace."""
+    stacks = {}
+    if not os.path.isfile(stacks_file_name):
+        return stacks
+    stack_id = None
+    with open(stacks_file_name, 'r') as file:
+        for line in file:
+            line = line.rstrip('\n')
+            if line.startswith('stack '):
+                stack_id = int(line[len('stack '):])
+                stacks[stack_id] = []
+            elif line and stack_id is not None:
+                stacks[stack_id].append(line)
+    return stacks
+
+
 class HeaphookAnalyzer:
 
     def __init__(self, input_file_name):
         self.input_file_name = input_file_name
+        # stack id to its frames, available when traced with stack ids
+        self.stacks = load_stack_table(
+            os.path.splitext(input_file_name)[0] + '.stacks')
+        # index in heap_consumption_transitions where the consumption peaks
+        self.peak_index = 0
 
         # list of XXXInfo (AllocInfo, DeallocInfo, ...)
         self.trace_data = []
@@ -104,7 +129,8 @@ class HeaphookAnalyzer:
                         int(lst[1]),        # size
                         int(lst[2]),        # align
                         int(lst[3], 16),    # addr
-                        int(lst[4]))        # time
+                        int(lst[4]),        # time
+                        int(lst[5]) if len(lst) > 5 else 0)  # stack id
                     self.trace_data.append(info)
                     if info.align > 1:
                         print(info)
@@ -133,7 +159,8 @@ class HeaphookAnalyzer:
                     info = AllocZeroedInfo(
                         int(lst[1]),        # size
                         int(lst[2], 16),    # addr
-                        int(lst[3]))        # time
+                        int(lst[3]),        # time
+                        int(lst[4]) if len(lst) > 4 else 0)  # stack id
                     self.trace_data.append(info)
                     if info.addr in addr2size:
                         # allocating the same area twice
@@ -147,7 +174,8 @@ class HeaphookAnalyzer:
                         int(lst[1], 16),    # old_addr
                         int(lst[2]),        # new_size
                         int(lst[3], 16),    # new_addr
-                        int(lst[4]))        # time
+                        int(lst[4]),        # time
+                        int(lst[5]) if len(lst) > 5 else 0)  # stack id
                     self.trace_data.append(info)
                     if info.old_addr not in addr2size:
                         # try reallocate area that is not allocated
@@ -170,6 +198,8 @@ class HeaphookAnalyzer:
                         self.get_block_size_before_alloc += 1
 
                 self.heap_consumption_transitions.append(allocated_memory_size)
+                if allocated_memory_size > self.heap_consumption_transitions[self.peak_index]:
+                    self.peak_index = len(self.heap_consumption_transitions) - 1
 
         self.alloc_info_list = list(filter(
             lambda info: isinstance(info, AllocInfo), self.trace_data))
@@ -199,6 +229,53 @@ class HeaphookAnalyzer:
         print(f'the number of get_block_size before alloc is '
               f'{self.get_block_size_before_alloc}')
 
+    def live_allocations_at(self, index):
+        """Return {addr: (size, stack_id)} just after the index-th method call."""
+        live = {}
+        for info in self.trace_data[:index]:
+            if isinstance(info, (AllocInfo, AllocZeroedInfo)):
+                live[info.addr] = (info.size, info.stack_id)
+            elif isinstance(info, DeallocInfo):
+                live.pop(info.addr, None)
+            elif isinstance(info, ReallocInfo):
+                if info.old_addr in live:
+                    live.pop(info.old_addr)
+                    live[info.new_addr] = (info.new_size, info.stack_id)
+        return live
+
+    def show_stacks(self, bytes_by_stack, calls_by_stack, num_tops):
+        ranking = sorted(bytes_by_stack.items(), key=lambda e: e[1], reverse=True)
+        for stack_id, num_bytes in ranking[:num_tops]:
+            print(f'{num_bytes} bytes with {calls_by_stack[stack_id]} blocks, stack {stack_id}:')
+            for frame in self.stacks.get(stack_id, ['(unknown stack)']):
+                print(f'    {frame}')
+            print('')
+
+    def show_live_stacks_at_peak(self, num_tops):
+        print(f'heap consumption peaks at method index {self.peak_index} '
+              f'with {self.heap_consumption_transitions[self.peak_index]} bytes')
+        bytes_by_stack = {}
+        calls_by_stack = {}
+        for size, stack_id in self.live_allocations_at(self.peak_index).values():
+            bytes_by_stack[stack_id] = bytes_by_stack.get(stack_id, 0) + size
+            calls_by_stack[stack_id] = calls_by_stack.get(stack_id, 0) + 1
+        self.show_stacks(bytes_by_stack, calls_by_stack, num_tops)
+
+    def show_allocations_in_window(self, begin, end, num_tops):
+        print(f'allocations between method index {begin} and {end}')
+        bytes_by_stack = {}
+        calls_by_stack = {}
+        for info in self.trace_data[begin:end]:
+            if isinstance(info, (AllocInfo, AllocZeroedInfo)):
+                size = info.size
+            elif isinstance(info, ReallocInfo):
+                size = info.new_size
+            else:
+                continue
+            bytes_by_stack[info.stack_id] = bytes_by_stack.get(info.stack_id, 0) + size
+            calls_by_stack[info.stack_id] = calls_by_stack.get(info.stack_id, 0) + 1
+        self.show_stacks(bytes_by_stack, calls_by_stack, num_tops)
+
     def plot_heap_consumption_transitions(self, output_file_name):
         x = list(range(len(self.heap_consumption_transitions)))
         y = self.heap_consumption_transitions
@@ -233,9 +310,22 @@ def create_png_file_name(file_name, addtext):
 
 
 if __name__ == '__main__':
-    input_file_name = sys.argv[1]
+    parser = argparse.ArgumentParser()
+    parser.add_argument('input_file_name', help='heap trace log like heaplog_123.log')
+    parser.add_argument('--live-at-peak', action='store_true',
+                        help='show the call stacks of the blocks live at the heap peak')
+    parser.add_argument('--window', nargs=2, type=int, metavar=('BEGIN', 'END'),
+                        help='show the call stacks which allocated between two method indices')
+    parser.add_argument('--num-tops', type=int, default=10,
+                        help='number of call stacks to show')
+    args = parser.parse_args()
+    input_file_name = args.input_file_name
     analyzer = HeaphookAnalyzer(input_file_name)
     analyzer.show_analysis_summary()
+    if args.live_at_peak:
+        analyzer.show_live_stacks_at_peak(args.num_tops)
+    if args.window:
+        analyzer.show_allocations_in_window(args.window[0], args.window[1], args.num_tops)
     analyzer.plot_heap_consumption_transitions(
         create_png_file_name(input_file_name, '_heap_consumption_transitions'))
     analyzer.plot_method_performance(
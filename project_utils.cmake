@@ -1,8 +1,10 @@
 # heaphook implementations
 set(HEAPHOOK_SOURCES
+  ${heaphook_SOURCE_DIR}/src/heaphook/arena.cpp
   ${heaphook_SOURCE_DIR}/src/heaphook/heaptracer.cpp
   ${heaphook_SOURCE_DIR}/src/heaphook/hook_functions.cpp
   ${heaphook_SOURCE_DIR}/src/heaphook/heaphook.cpp
+  ${heaphook_SOURCE_DIR}/src/heaphook/stack_table.cpp
   ${heaphook_SOURCE_DIR}/src/heaphook/utils.cpp)
 
 # build_library function
@@ -3,8 +3,11 @@
 
 #include <dlfcn.h>
 #include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
-#include <array>
+#include <algorithm>
+#include <chrono>
 #include <memory_resource>
 #include <queue>
 #include <unordered_map>
@@ -20,7 +23,14 @@ using namespace heaphook;
 // internally. We should avoid using them as much as possible.
 // When the implementation needs memory, it's better to use stack or data segment.
 
+// Page faults are attributed to the call site in two parts: the minor faults
+// taken by the thread inside the underlying allocator, and the pages of the
+// returned block that are not resident yet and fault on their first touch.
+
 constexpr size_t MAX_NUM_BACKTRACE_FRAMES = 32;
+// The records start in a small arena which grows on demand, so that preloading
+// the profiler into many processes does not reserve a large buffer in each.
+constexpr size_t INITIAL_RECORD_ARENA_SIZE = 1024 * 1024;
 thread_local static int g_use_vanilla_allocator = 0;
 
 struct BackTrace
@@ -54,17 +64,69 @@ struct AllocRecord
 {
   size_t bytes_;
   size_t num_calls_;
+  size_t num_page_faults_;
+  // nanoseconds spent in the underlying allocator
+  size_t total_alloc_ns_;
+  size_t max_alloc_ns_;
 
   AllocRecord() = default;
-  AllocRecord(size_t bytes) : bytes_(bytes), num_calls_(1) {}
+  AllocRecord(size_t bytes, size_t page_faults, size_t alloc_ns)
+  : bytes_(bytes), num_calls_(1), num_page_faults_(page_faults), total_alloc_ns_(alloc_ns),
+    max_alloc_ns_(alloc_ns) {}
 
-  void inc_amount(size_t delta)
+  void inc_amount(size_t delta, size_t page_faults, size_t alloc_ns)
   {
     bytes_ += delta;
     num_calls_ += 1;
+    num_page_faults_ += page_faults;
+    total_alloc_ns_ += alloc_ns;
+    max_alloc_ns_ = std::max(max_alloc_ns_, alloc_ns);
   }
 };
 
+enum class SortKey
+{
+  Bytes,
+  NumCalls,
+  PageFaults,
+  AllocTime,
+};
+
+static size_t count_minor_faults()
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_THREAD, &usage) != 0) {
+    return 0;
+  }
+  return usage.ru_minflt;
+}
+
+// Count the pages overlapping [ptr, ptr + bytes) that are not backed by
+// physical memory yet, i.e. the pages which will fault when first written.
+static size_t count_untouched_pages(void * ptr, size_t bytes)
+{
+  static size_t page_size = sysconf(_SC_PAGESIZE);
+  constexpr size_t MAX_PAGES_PER_QUERY = 256;
+  unsigned char residency[MAX_PAGES_PER_QUERY];
+
+  size_t begin = reinterpret_cast<size_t>(ptr) & ~(page_size - 1);
+  size_t end = (reinterpret_cast<size_t>(ptr) + bytes + page_size - 1) & ~(page_size - 1);
+  size_t num_untouched = 0;
+  while (begin < end) {
+    size_t num_pages = std::min((end - begin) / page_size, MAX_PAGES_PER_QUERY);
+    if (mincore(reinterpret_cast<void *>(begin), num_pages * page_size, residency) != 0) {
+      break;
+    }
+    for (size_t i = 0; i < num_pages; i++) {
+      if (!(residency[i] & 1)) {
+        num_untouched++;
+      }
+    }
+    begin += num_pages * page_size;
+  }
+  return num_untouched;
+}
+
 namespace std
 {
 
@@ -76,6 +138,52 @@ struct hash<BackTrace>
 
 }  // namespace std
 
+// This memory resource serves every request with a dedicated anonymous mapping.
+// It is used as the upstream of the monotonic buffer resource holding the records,
+// which asks for geometrically growing chunks as the number of stacks increases.
+class MmapMemoryResource : public std::pmr::memory_resource
+{
+  size_t mapped_bytes_ = 0;
+  size_t num_chunks_ = 0;
+
+  static size_t round_up_to_page(size_t bytes)
+  {
+    static size_t page_size = sysconf(_SC_PAGESIZE);
+    return (bytes + page_size - 1) & ~(page_size - 1);
+  }
+
+  void * do_allocate(size_t bytes, size_t alignment) override
+  {
+    (void) alignment; // mappings are page aligned
+    size_t len = round_up_to_page(bytes);
+    void * addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    mapped_bytes_ += len;
+    num_chunks_++;
+    return addr;
+  }
+
+  void do_deallocate(void * ptr, size_t bytes, size_t alignment) override
+  {
+    (void) alignment;
+    size_t len = round_up_to_page(bytes);
+    munmap(ptr, len);
+    mapped_bytes_ -= len;
+    num_chunks_--;
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override
+  {
+    return this == &other;
+  }
+
+public:
+  size_t mapped_bytes() const {return mapped_bytes_;}
+  size_t num_chunks() const {return num_chunks_;}
+};
+
 class VanillaAllocator : public GlobalAllocator
 {
   void * do_alloc(size_t bytes, size_t align) override
@@ -103,14 +211,21 @@ class VanillaAllocator : public GlobalAllocator
       reinterpret_cast<malloc_usable_size_type>(dlsym(RTLD_NEXT, "malloc_usable_size"));
     return original_malloc_usable_size(ptr);
   }
+
+  int do_trim(size_t pad) override
+  {
+    static malloc_trim_type original_malloc_trim =
+      reinterpret_cast<malloc_trim_type>(dlsym(RTLD_NEXT, "malloc_trim"));
+    return original_malloc_trim(pad);
+  }
 };
 
 class BacktraceAllocator : public VanillaAllocator
 {
 private:
+  MmapMemoryResource arena_;
   std::pmr::monotonic_buffer_resource buf_resource_;
   std::pmr::unordered_map<BackTrace, AllocRecord> alloc_records_;
-  std::array<std::byte, 64 * 1024 * 1024> mem_buf_;
 
   void * do_alloc(size_t bytes, size_t align) override
   {
@@ -118,26 +233,38 @@ private:
     struct BackTrace bt;
     bt.num_frames_ = backtrace(bt.frame_ptrs_, MAX_NUM_BACKTRACE_FRAMES);
 
-    auto it = alloc_records_.find(bt);
-    if (it != alloc_records_.end()) {
-      it->second.inc_amount(bytes);
-    } else {
-      alloc_records_[bt] = AllocRecord(bytes);
-    }
-    g_use_vanilla_allocator = 0;
-
+    size_t faults_before = count_minor_faults();
+    auto start_time = std::chrono::high_resolution_clock::now();
+    void * retval;
     if (align == 1) {
       static malloc_type original_malloc =
         reinterpret_cast<malloc_type>(dlsym(RTLD_NEXT, "malloc"));
-      return original_malloc(bytes);
+      retval = original_malloc(bytes);
     } else {
       static memalign_type original_memalign =
         reinterpret_cast<memalign_type>(dlsym(RTLD_NEXT, "memalign"));
-      return original_memalign(align, bytes);
+      retval = original_memalign(align, bytes);
+    }
+    auto end_time = std::chrono::high_resolution_clock::now();
+    size_t alloc_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      end_time - start_time).count();
+    size_t page_faults = count_minor_faults() - faults_before;
+    if (retval != nullptr) {
+      page_faults += count_untouched_pages(retval, bytes);
     }
+
+    auto it = alloc_records_.find(bt);
+    if (it != alloc_records_.end()) {
+      it->second.inc_amount(bytes, page_faults, alloc_ns);
+    } else {
+      alloc_records_[bt] = AllocRecord(bytes, page_faults, alloc_ns);
+    }
+    g_use_vanilla_allocator = 0;
+
+    return retval;
   }
 
-  int save_top_allocs(const char * output_filename, const bool bytes_based)
+  int save_top_allocs(const char * output_filename, const SortKey sort_key)
   {
     FILE * fp = fopen(output_filename, "w");
     char line[1024];
@@ -168,14 +295,28 @@ private:
 
     compare_t cmp;
 
-    if (bytes_based) {
-      cmp = [](const bt_record_pair_t & a, const bt_record_pair_t & b) {
-        return a.second.bytes_ > b.second.bytes_;
-      };
-    } else {
-      cmp = [](const bt_record_pair_t & a, const bt_record_pair_t & b) {
-        return a.second.num_calls_ > b.second.num_calls_;
-      };
+    switch (sort_key) {
+      case SortKey::Bytes:
+        cmp = [](const bt_record_pair_t & a, const bt_record_pair_t & b) {
+          return a.second.bytes_ > b.second.bytes_;
+        };
+        break;
+      case SortKey::NumCalls:
+        cmp = [](const bt_record_pair_t & a, const bt_record_pair_t & b) {
+          return a.second.num_calls_ > b.second.num_calls_;
+        };
+        break;
+      case SortKey::PageFaults:
+        cmp = [](const bt_record_pair_t & a, const bt_record_pair_t & b) {
+          return a.second.num_page_faults_ > b.second.num_page_faults_;
+        };
+        break;
+      case SortKey::AllocTime:
+      default:
+        cmp = [](const bt_record_pair_t & a, const bt_record_pair_t & b) {
+          return a.second.total_alloc_ns_ > b.second.total_alloc_ns_;
+        };
+        break;
     }
 
     std::priority_queue<bt_record_pair_t, std::vector<bt_record_pair_t>, decltype(cmp)> min_pq(cmp);
@@ -200,8 +341,10 @@ private:
       is_first_write = false;
 
       snprintf(
-        line, sizeof(line), "Allocate %ld bytes with %ld calls:\n", record.bytes_,
-        record.num_calls_);
+        line, sizeof(line),
+        "Allocate %ld bytes with %ld calls, causing %ld page faults, taking %ld ns (max %ld ns):\n",
+        record.bytes_, record.num_calls_, record.num_page_faults_, record.total_alloc_ns_,
+        record.max_alloc_ns_);
       fputs(line, fp);
 
       char buf[4096] = {0};
@@ -215,7 +358,7 @@ private:
   }
 
 public:
-  BacktraceAllocator() : buf_resource_{mem_buf_.data(), mem_buf_.size(), std::pmr::null_memory_resource()}, alloc_records_(&buf_resource_)
+  BacktraceAllocator() : buf_resource_{INITIAL_RECORD_ARENA_SIZE, &arena_}, alloc_records_(&buf_resource_)
   {
   }
 
@@ -225,10 +368,14 @@ public:
 
     size_t total_bytes = 0;
     size_t total_num_calls = 0;
+    size_t total_page_faults = 0;
+    size_t total_alloc_ns = 0;
     int num_items = alloc_records_.size();
     for (const auto & [bt, record] : alloc_records_) {
       total_bytes += record.bytes_;
       total_num_calls += record.num_calls_;
+      total_page_faults += record.num_page_faults_;
+      total_alloc_ns += record.total_alloc_ns_;
       num_items--;
       if (num_items <= 0) {
         // gcc-bug: The ranged-for loop can become an infinite loop in rare cases, use counter to break out.
@@ -239,18 +386,31 @@ public:
     {
       char line[1024] = {0};
       snprintf(
-        line, sizeof(line), "%lu backtraces: allocate %lu bytes with %lu malloc/new calls.",
-        alloc_records_.size(), total_bytes, total_num_calls);
+        line, sizeof(line),
+        "%lu backtraces: allocate %lu bytes with %lu malloc/new calls, causing %lu page faults, "
+        "taking %lu ns.",
+        alloc_records_.size(), total_bytes, total_num_calls, total_page_faults, total_alloc_ns);
+      puts(line);
+
+      snprintf(
+        line, sizeof(line), "Backtrace records use %lu bytes in %lu mmap chunks.",
+        arena_.mapped_bytes(), arena_.num_chunks());
       puts(line);
     }
 
     {
       char output_filename[64] = {0};
       snprintf(output_filename, sizeof(output_filename), "top_alloc_bytes_bt.%d.%d.log", getpid(), gettid());
-      save_top_allocs(output_filename, true);
+      save_top_allocs(output_filename, SortKey::Bytes);
 
       snprintf(output_filename, sizeof(output_filename), "top_num_calls_bt.%d.%d.log", getpid(), gettid());
-      save_top_allocs(output_filename, false);
+      save_top_allocs(output_filename, SortKey::NumCalls);
+
+      snprintf(output_filename, sizeof(output_filename), "top_page_faults_bt.%d.%d.log", getpid(), gettid());
+      save_top_allocs(output_filename, SortKey::PageFaults);
+
+      snprintf(output_filename, sizeof(output_filename), "top_alloc_time_bt.%d.%d.log", getpid(), gettid());
+      save_top_allocs(output_filename, SortKey::AllocTime);
     }
     g_use_vanilla_allocator = 0;
   }
@@ -0,0 +1,264 @@
+// This tool compares two reports generated by libpreloaded_backtrace.so
+// (e.g. top_num_calls_bt.<pid>.<tid>.log before and after an optimization)
+// and prints the per call site deltas sorted by absolute change.
+//
+// Call sites are matched by their symbolized stacks with the addresses and offsets removed,
+// so that reports taken from different runs (with different ASLR layouts) and different builds
+// can be compared.
+// Sites found in only one report are compared against zero, so generate both reports
+// with a large NUM_TOPS to compare the whole set of call sites.
+//
+// Usage:
+//   backtrace_diff [options] <before report> <after report>
+//
+// Options:
+//   --sort bytes|calls|faults|time  key to sort the sites by (default: calls)
+//   --num-tops N                    show only the first N sites (default: all)
+//   --max-bytes-increase N          fail if a site allocates more than N bytes more
+//   --max-calls-increase N          fail if a site makes more than N calls more
+//
+// Exit status is 0 on success, 1 when a threshold is exceeded and 2 on errors.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+struct SiteStats
+{
+  int64_t bytes = 0;
+  int64_t num_calls = 0;
+  int64_t num_page_faults = 0;
+  int64_t alloc_ns = 0;
+};
+
+struct SiteDelta
+{
+  std::string stack;
+  SiteStats before;
+  SiteStats after;
+};
+
+enum class SortKey
+{
+  Bytes,
+  NumCalls,
+  PageFaults,
+  AllocTime,
+};
+
+// "/path/lib.so(func+0x81) [0x712ae9355f61]" -> "/path/lib.so(func)"
+// "/path/exe(+0x3fbef) [0x55d0c2a3dbef]"     -> "/path/exe"
+// the offsets change whenever the code is rebuilt, so a frame is identified by its function,
+// or by its module when the function is unknown.
+static std::string normalize_frame(const std::string & frame)
+{
+  std::string name = frame.substr(0, frame.rfind('['));
+  while (!name.empty() && name.back() == ' ') {
+    name.pop_back();
+  }
+
+  auto open = name.rfind('(');
+  auto close = name.rfind(')');
+  if (open == std::string::npos || close == std::string::npos || close < open) {
+    return name;
+  }
+  std::string symbol = name.substr(open + 1, close - open - 1);
+  symbol = symbol.substr(0, symbol.find('+'));
+  if (symbol.empty()) {
+    return name.substr(0, open);
+  }
+  return name.substr(0, open + 1) + symbol + ")";
+}
+
+static bool parse_header(const std::string & line, SiteStats & stats)
+{
+  long long bytes = 0, num_calls = 0, num_page_faults = 0, alloc_ns = 0;
+  // older reports only have the first two fields
+  int num_fields = sscanf(
+    line.c_str(), "Allocate %lld bytes with %lld calls, causing %lld page faults, taking %lld ns",
+    &bytes, &num_calls, &num_page_faults, &alloc_ns);
+  if (num_fields < 2) {
+    return false;
+  }
+  stats.bytes = bytes;
+  stats.num_calls = num_calls;
+  stats.num_page_faults = num_page_faults;
+  stats.alloc_ns = alloc_ns;
+  return true;
+}
+
+static bool load_report(const char * file_name, std::map<std::string, SiteStats> & sites)
+{
+  std::ifstream ifs(file_name);
+  if (!ifs) {
+    std::cerr << "backtrace_diff: cannot open " << file_name << std::endl;
+    return false;
+  }
+
+  std::string line;
+  std::string stack;
+  SiteStats stats;
+  bool in_entry = false;
+  auto flush = [&]() {
+      if (in_entry) {
+        SiteStats & site = sites[stack];
+        site.bytes += stats.bytes;
+        site.num_calls += stats.num_calls;
+        site.num_page_faults += stats.num_page_faults;
+        site.alloc_ns += stats.alloc_ns;
+      }
+      in_entry = false;
+      stack.clear();
+    };
+
+  while (std::getline(ifs, line)) {
+    if (line.empty()) {
+      flush();
+    } else if (!in_entry) {
+      if (!parse_header(line, stats)) {
+        std::cerr << "backtrace_diff: unexpected line in " << file_name << ": " << line <<
+          std::endl;
+        return false;
+      }
+      in_entry = true;
+    } else {
+      stack += normalize_frame(line);
+      stack += '\n';
+    }
+  }
+  flush();
+  return true;
+}
+
+static int64_t key_of(const SiteStats & stats, SortKey key)
+{
+  switch (key) {
+    case SortKey::Bytes:
+      return stats.bytes;
+    case SortKey::NumCalls:
+      return stats.num_calls;
+    case SortKey::PageFaults:
+      return stats.num_page_faults;
+    case SortKey::AllocTime:
+    default:
+      return stats.alloc_ns;
+  }
+}
+
+static void usage()
+{
+  std::cerr <<
+    "usage: backtrace_diff [--sort bytes|calls|faults|time] [--num-tops N]\n"
+    "                      [--max-bytes-increase N] [--max-calls-increase N]\n"
+    "                      <before report> <after report>\n";
+}
+
+int main(int argc, char ** argv)
+{
+  SortKey sort_key = SortKey::NumCalls;
+  size_t num_tops = SIZE_MAX;
+  int64_t max_bytes_increase = INT64_MAX;
+  int64_t max_calls_increase = INT64_MAX;
+  std::vector<const char *> file_names;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--sort") == 0 && has_value) {
+      const char * key = argv[++i];
+      if (strcmp(key, "bytes") == 0) {
+        sort_key = SortKey::Bytes;
+      } else if (strcmp(key, "calls") == 0) {
+        sort_key = SortKey::NumCalls;
+      } else if (strcmp(key, "faults") == 0) {
+        sort_key = SortKey::PageFaults;
+      } else if (strcmp(key, "time") == 0) {
+        sort_key = SortKey::AllocTime;
+      } else {
+        usage();
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--num-tops") == 0 && has_value) {
+      num_tops = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--max-bytes-increase") == 0 && has_value) {
+      max_bytes_increase = strtoll(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--max-calls-increase") == 0 && has_value) {
+      max_calls_increase = strtoll(argv[++i], nullptr, 10);
+    } else if (argv[i][0] == '-') {
+      usage();
+      return 2;
+    } else {
+      file_names.push_back(argv[i]);
+    }
+  }
+  if (file_names.size() != 2) {
+    usage();
+    return 2;
+  }
+
+  std::map<std::string, SiteStats> before, after;
+  if (!load_report(file_names[0], before) || !load_report(file_names[1], after)) {
+    return 2;
+  }
+
+  std::vector<SiteDelta> deltas;
+  for (const auto & [stack, stats] : before) {
+    deltas.push_back(SiteDelta{stack, stats, after.count(stack) ? after[stack] : SiteStats{}});
+  }
+  for (const auto & [stack, stats] : after) {
+    if (!before.count(stack)) {
+      deltas.push_back(SiteDelta{stack, SiteStats{}, stats});
+    }
+  }
+
+  std::stable_sort(
+    deltas.begin(), deltas.end(), [sort_key](const SiteDelta & a, const SiteDelta & b) {
+      return std::llabs(key_of(a.after, sort_key) - key_of(a.before, sort_key)) >
+      std::llabs(key_of(b.after, sort_key) - key_of(b.before, sort_key));
+    });
+
+  int status = 0;
+  SiteStats total_before, total_after;
+  for (size_t i = 0; i < deltas.size(); i++) {
+    const SiteDelta & d = deltas[i];
+    total_before.bytes += d.before.bytes;
+    total_before.num_calls += d.before.num_calls;
+    total_before.num_page_faults += d.before.num_page_faults;
+    total_before.alloc_ns += d.before.alloc_ns;
+    total_after.bytes += d.after.bytes;
+    total_after.num_calls += d.after.num_calls;
+    total_after.num_page_faults += d.after.num_page_faults;
+    total_after.alloc_ns += d.after.alloc_ns;
+
+    bool regressed = d.after.bytes - d.before.bytes > max_bytes_increase ||
+      d.after.num_calls - d.before.num_calls > max_calls_increase;
+    if (regressed) {
+      status = 1;
+    }
+    if (i >= num_tops && !regressed) {
+      continue;
+    }
+
+    printf(
+      "%s%+" PRId64 " bytes, %+" PRId64 " calls, %+" PRId64 " page faults, %+" PRId64 " ns "
+      "(calls: %" PRId64 " -> %" PRId64 "):\n%s\n",
+      regressed ? "REGRESSION " : "",
+      d.after.bytes - d.before.bytes, d.after.num_calls - d.before.num_calls,
+      d.after.num_page_faults - d.before.num_page_faults, d.after.alloc_ns - d.before.alloc_ns,
+      d.before.num_calls, d.after.num_calls, d.stack.c_str());
+  }
+
+  printf(
+    "Total: %+" PRId64 " bytes, %+" PRId64 " calls, %+" PRId64 " page faults, %+" PRId64 " ns "
+    "over %zu call sites.\n",
+    total_after.bytes - total_before.bytes, total_after.num_calls - total_before.num_calls,
+    total_after.num_page_faults - total_before.num_page_faults,
+    total_after.alloc_ns - total_before.alloc_ns, deltas.size());
+  return status;
+}
@@ -0,0 +1,352 @@
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "tlsf/tlsf.h"
+#include "../tlsf/slab.hpp"
+
+#include "heaphook/heaphook.hpp"
+#include "heaphook/hook_types.hpp"
+#include "heaphook/utils.hpp"
+
+using namespace heaphook;
+
+// This allocator routes each request by its size to the sub-allocator suited to it:
+//
+// * small: up to SMALL_MAX bytes (COMPOSITE_SMALL_MAX, at most 256) from slabs in an arena of
+//   SLAB_ARENA_SIZE bytes (COMPOSITE_SLAB_ARENA_SIZE)
+// * medium: from a TLSF pool of POOL_SIZE bytes (COMPOSITE_POOL_SIZE)
+// * large: LARGE_MIN bytes or more (COMPOSITE_LARGE_MIN) from a mapping of their own,
+//   which realloc resizes with mremap
+//
+// A request falls through to the next sub-allocator when its own is exhausted.
+// dealloc and get_block_size find the sub-allocator of a pointer from its address alone:
+// the slab arena and the TLSF pool are single address ranges, and a pointer outside both is a
+// mapping, recognized by a cookie in its header.
+static size_t SMALL_MAX = SlabAllocator::kMaxSize;
+static size_t SLAB_ARENA_SIZE = 16 * 1000 * 1000; // default: 16MB
+static size_t POOL_SIZE = 100 * 1000 * 1000; // default: 100MB
+static size_t LARGE_MIN = 1024 * 1024; // default: 1MB
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static char * pool = nullptr;
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static size_t page_size = 4096;
+
+// getenv and strtoull do not allocate, so the sub-allocators are set up inside the first malloc
+static size_t size_from_env(const char * name, size_t default_size)
+{
+  const char * env_p = getenv(name);
+  return env_p ? strtoull(env_p, nullptr, 10) : default_size;
+}
+
+static char * map_region(size_t size)
+{
+  void * addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return addr == MAP_FAILED ? nullptr : static_cast<char *>(addr);
+}
+
+static void init_sub_allocators()
+{
+  page_size = sysconf(_SC_PAGESIZE);
+  SMALL_MAX = size_from_env("COMPOSITE_SMALL_MAX", SMALL_MAX);
+  if (SMALL_MAX > SlabAllocator::kMaxSize) {
+    write_to_stderr(
+      "composite allocator: COMPOSITE_SMALL_MAX is at most ", SlabAllocator::kMaxSize, ".\n");
+    SMALL_MAX = SlabAllocator::kMaxSize;
+  }
+  SLAB_ARENA_SIZE = size_from_env("COMPOSITE_SLAB_ARENA_SIZE", SLAB_ARENA_SIZE);
+  POOL_SIZE = size_from_env("COMPOSITE_POOL_SIZE", POOL_SIZE);
+  LARGE_MIN = size_from_env("COMPOSITE_LARGE_MIN", LARGE_MIN);
+
+  if (SMALL_MAX > 0 && SLAB_ARENA_SIZE > 0) {
+    if (char * arena = map_region(SLAB_ARENA_SIZE)) {
+      SlabAllocator::getInstance().init(arena, SLAB_ARENA_SIZE, nullptr);
+    } else {
+      write_to_stderr("composite allocator: failed to map the slab arena.\n");
+    }
+  }
+
+  if (POOL_SIZE > 0) {
+    pool = map_region(POOL_SIZE);
+    if (pool != nullptr) {
+      init_memory_pool(POOL_SIZE, pool); // tlsf library function
+    } else {
+      write_to_stderr("composite allocator: failed to map the TLSF pool.\n");
+    }
+  }
+}
+
+static inline bool in_pool(void * ptr)
+{
+  char * addr = static_cast<char *>(ptr);
+  return addr >= pool && addr < pool + POOL_SIZE;
+}
+
+// Medium blocks with an alignment above TLSF_ALIGNMENT are tagged as in libpreloaded_tlsf:
+// the word before the aligned pointer holds its offset from the TLSF block, with the lowest
+// bit set, which is never set in the size word of a used block.
+static constexpr size_t TLSF_ALIGNMENT = 2 * sizeof(void *);
+static constexpr size_t BLOCK_SIZE_MASK = ~0b1111ull;
+static constexpr size_t ALIGNED_TAG = 0b1;
+
+static inline size_t header_word(void * ptr)
+{
+  return reinterpret_cast<size_t *>(ptr)[-1];
+}
+
+static void * medium_alloc(size_t size, size_t align)
+{
+  if (pool == nullptr) {
+    return nullptr;
+  }
+  size_t extra = align > TLSF_ALIGNMENT ? align - TLSF_ALIGNMENT : 0;
+  size_t bytes;
+  if (__builtin_add_overflow(size, extra, &bytes)) {
+    return nullptr;
+  }
+  pthread_mutex_lock(&pool_mtx);
+  char * addr = static_cast<char *>(malloc_ex(bytes, pool));
+  pthread_mutex_unlock(&pool_mtx);
+  if (addr == nullptr || extra == 0) {
+    return addr;
+  }
+  size_t offset = (align - reinterpret_cast<uintptr_t>(addr) % align) % align;
+  if (offset == 0) {
+    return addr;
+  }
+  char * aligned = addr + offset;
+  reinterpret_cast<size_t *>(aligned)[-1] = offset | ALIGNED_TAG;
+  return aligned;
+}
+
+static void medium_dealloc(void * ptr)
+{
+  size_t word = header_word(ptr);
+  if (word & ALIGNED_TAG) {
+    ptr = static_cast<char *>(ptr) - (word & BLOCK_SIZE_MASK);
+  }
+  pthread_mutex_lock(&pool_mtx);
+  free_ex(ptr, pool);
+  pthread_mutex_unlock(&pool_mtx);
+}
+
+static size_t medium_block_size(void * ptr)
+{
+  size_t word = header_word(ptr);
+  if (word & ALIGNED_TAG) {
+    size_t offset = word & BLOCK_SIZE_MASK;
+    return (header_word(static_cast<char *>(ptr) - offset) & BLOCK_SIZE_MASK) - offset;
+  }
+  return word & BLOCK_SIZE_MASK;
+}
+
+// Large blocks start align bytes (at least 16) into their mapping, after a header holding the
+// mapping size and a cookie derived from the pointer, so alignments up to the page size are
+// supported. The header lies on the first page, so the mapping starts at the page of the header.
+struct LargeBlock
+{
+  size_t mapped_size;
+  uintptr_t cookie;
+};
+
+static constexpr uintptr_t LARGE_BLOCK_MAGIC = 0x636f6d706f736974ull;
+
+static inline LargeBlock * large_header_of(void * ptr)
+{
+  return static_cast<LargeBlock *>(ptr) - 1;
+}
+
+static inline char * large_mapping_of(void * ptr)
+{
+  return reinterpret_cast<char *>(
+    reinterpret_cast<uintptr_t>(large_header_of(ptr)) & ~(page_size - 1));
+}
+
+static inline bool is_large(void * ptr)
+{
+  return large_header_of(ptr)->cookie == (reinterpret_cast<uintptr_t>(ptr) ^ LARGE_BLOCK_MAGIC);
+}
+
+// returns 0 on overflow
+static size_t large_mapped_size(size_t offset, size_t size)
+{
+  size_t bytes;
+  if (__builtin_add_overflow(size, offset + page_size - 1, &bytes)) {
+    return 0;
+  }
+  return bytes & ~(page_size - 1);
+}
+
+static void * large_alloc(size_t size, size_t align)
+{
+  if (align > page_size) {
+    return nullptr;
+  }
+  size_t offset = align > sizeof(LargeBlock) ? align : sizeof(LargeBlock);
+  size_t mapped_size = large_mapped_size(offset, size);
+  if (mapped_size == 0) {
+    return nullptr;
+  }
+  char * mapping = map_region(mapped_size);
+  if (mapping == nullptr) {
+    return nullptr;
+  }
+  char * ptr = mapping + offset;
+  large_header_of(ptr)->mapped_size = mapped_size;
+  large_header_of(ptr)->cookie = reinterpret_cast<uintptr_t>(ptr) ^ LARGE_BLOCK_MAGIC;
+  return ptr;
+}
+
+static void large_dealloc(void * ptr)
+{
+  large_header_of(ptr)->cookie = 0;
+  munmap(large_mapping_of(ptr), large_header_of(ptr)->mapped_size);
+}
+
+static size_t large_block_size(void * ptr)
+{
+  char * end = large_mapping_of(ptr) + large_header_of(ptr)->mapped_size;
+  return end - static_cast<char *>(ptr);
+}
+
+static void * large_realloc(void * ptr, size_t new_size)
+{
+  char * mapping = large_mapping_of(ptr);
+  size_t offset = static_cast<char *>(ptr) - mapping;
+  size_t old_mapped_size = large_header_of(ptr)->mapped_size;
+  size_t mapped_size = large_mapped_size(offset, new_size);
+  if (mapped_size == 0) {
+    return nullptr;
+  }
+  if (mapped_size == old_mapped_size) {
+    return ptr;
+  }
+  void * addr = mremap(mapping, old_mapped_size, mapped_size, MREMAP_MAYMOVE);
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+  // the offset within the page, and so the alignment, is kept
+  ptr = static_cast<char *>(addr) + offset;
+  large_header_of(ptr)->mapped_size = mapped_size;
+  large_header_of(ptr)->cookie = reinterpret_cast<uintptr_t>(ptr) ^ LARGE_BLOCK_MAGIC;
+  return ptr;
+}
+
+enum class SubAllocator
+{
+  Slab,
+  Tlsf,
+  Mapping,
+  Foreign, // allocated by the dynamic loader before the library was loaded
+};
+
+// two range checks and a cookie check, with no lookup table
+static SubAllocator sub_allocator_of(void * ptr)
+{
+  if (SlabAllocator::getInstance().contains(ptr)) {
+    return SubAllocator::Slab;
+  }
+  if (in_pool(ptr)) {
+    return SubAllocator::Tlsf;
+  }
+  return is_large(ptr) ? SubAllocator::Mapping : SubAllocator::Foreign;
+}
+
+class CompositeAllocator : public GlobalAllocator
+{
+  void * do_alloc(size_t size, size_t align) override
+  {
+    pthread_once(&init_once, init_sub_allocators);
+
+    SlabAllocator & slab_allocator = SlabAllocator::getInstance();
+    if (size <= SMALL_MAX && align <= TLSF_ALIGNMENT && slab_allocator.enabled()) {
+      if (void * ptr = slab_allocator.alloc(size)) {
+        return ptr;
+      }
+    }
+    if (size < LARGE_MIN || align > page_size) {
+      if (void * ptr = medium_alloc(size, align)) {
+        return ptr;
+      }
+    }
+    return large_alloc(size, align);
+  }
+
+  void do_dealloc(void * ptr) override
+  {
+    switch (sub_allocator_of(ptr)) {
+      case SubAllocator::Slab:
+        SlabAllocator::getInstance().dealloc(ptr);
+        break;
+      case SubAllocator::Tlsf:
+        medium_dealloc(ptr);
+        break;
+      case SubAllocator::Mapping:
+        large_dealloc(ptr);
+        break;
+      case SubAllocator::Foreign:
+      default: {
+          static free_type original_free = reinterpret_cast<free_type>(dlsym(RTLD_NEXT, "free"));
+          original_free(ptr);
+          break;
+        }
+    }
+  }
+
+  size_t do_get_block_size(void * ptr) override
+  {
+    switch (sub_allocator_of(ptr)) {
+      case SubAllocator::Slab:
+        return SlabAllocator::getInstance().get_block_size(ptr);
+      case SubAllocator::Tlsf:
+        return medium_block_size(ptr);
+      case SubAllocator::Mapping:
+        return large_block_size(ptr);
+      case SubAllocator::Foreign:
+      default: {
+          static malloc_usable_size_type original_malloc_usable_size =
+            reinterpret_cast<malloc_usable_size_type>(dlsym(RTLD_NEXT, "malloc_usable_size"));
+          return original_malloc_usable_size(ptr);
+        }
+    }
+  }
+
+  void * do_alloc_zeroed(size_t size) override
+  {
+    void * ptr = do_alloc(size, 1);
+    if (ptr != nullptr && sub_allocator_of(ptr) != SubAllocator::Mapping) {
+      memset(ptr, 0, size); // a fresh mapping is already zero
+    }
+    return ptr;
+  }
+
+  void * do_realloc(void * ptr, size_t new_size) override
+  {
+    if (new_size >= LARGE_MIN && sub_allocator_of(ptr) == SubAllocator::Mapping) {
+      return large_realloc(ptr, new_size);
+    }
+
+    size_t old_size = do_get_block_size(ptr);
+    if (new_size <= old_size && (new_size >= LARGE_MIN) == (old_size >= LARGE_MIN)) {
+      return ptr; // still in the right sub-allocator
+    }
+    void * ret = do_alloc(new_size, 1);
+    if (ret != nullptr) {
+      memcpy(ret, ptr, old_size < new_size ? old_size : new_size);
+      do_dealloc(ptr);
+    }
+    return ret;
+  }
+};
+
+GlobalAllocator & GlobalAllocator::get_instance()
+{
+  static CompositeAllocator composite;
+  return composite;
+}
@@ -0,0 +1,135 @@
+#include <cstdint>
+
+#include "heaphook/arena.h"
+#include "heaphook/heaphook.hpp"
+
+using namespace heaphook;
+
+static constexpr size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+struct ArenaChunk
+{
+  ArenaChunk * next;
+  size_t size; // bytes following the header
+};
+
+struct heaphook_arena
+{
+  ArenaChunk * first; // the chunks in the order they are used in
+  ArenaChunk * current;
+  uintptr_t cursor; // next free byte of current
+  uintptr_t end;
+  size_t chunk_size;
+};
+
+static uintptr_t chunk_begin(ArenaChunk * chunk)
+{
+  return reinterpret_cast<uintptr_t>(chunk + 1);
+}
+
+static void use_chunk(heaphook_arena_t * arena, ArenaChunk * chunk)
+{
+  arena->current = chunk;
+  arena->cursor = chunk_begin(chunk);
+  arena->end = arena->cursor + chunk->size;
+}
+
+// moves to a chunk with room for size bytes aligned to alignment.
+// the chunk after the current one is reused if it is large enough, and a new chunk is inserted
+// before it otherwise, so that reset keeps every chunk.
+static bool next_chunk(heaphook_arena_t * arena, size_t size, size_t alignment)
+{
+  size_t needed;
+  if (__builtin_add_overflow(size, alignment, &needed)) {
+    return false;
+  }
+
+  ArenaChunk * next = arena->current ? arena->current->next : arena->first;
+  if (next != nullptr && next->size >= needed) {
+    use_chunk(arena, next);
+    return true;
+  }
+
+  size_t chunk_size = needed > arena->chunk_size ? needed : arena->chunk_size;
+  size_t bytes;
+  if (__builtin_add_overflow(chunk_size, sizeof(ArenaChunk), &bytes)) {
+    return false;
+  }
+  ArenaChunk * chunk = static_cast<ArenaChunk *>(GlobalAllocator::get_instance().alloc(bytes));
+  if (chunk == nullptr) {
+    return false;
+  }
+  chunk->size = chunk_size;
+  chunk->next = next;
+  if (arena->current != nullptr) {
+    arena->current->next = chunk;
+  } else {
+    arena->first = chunk;
+  }
+  use_chunk(arena, chunk);
+  return true;
+}
+
+extern "C" {
+
+heaphook_arena_t * heaphook_arena_create(size_t chunk_size)
+{
+  auto arena = static_cast<heaphook_arena_t *>(
+    GlobalAllocator::get_instance().alloc(sizeof(heaphook_arena_t)));
+  if (arena == nullptr) {
+    return nullptr;
+  }
+  arena->first = nullptr;
+  arena->current = nullptr;
+  arena->cursor = 0;
+  arena->end = 0;
+  arena->chunk_size = chunk_size > 0 ? chunk_size : DEFAULT_CHUNK_SIZE;
+  return arena;
+}
+
+void * heaphook_arena_alloc(heaphook_arena_t * arena, size_t size, size_t alignment)
+{
+  if (alignment == 0) {
+    alignment = alignof(max_align_t);
+  }
+  if ((alignment & (alignment - 1)) != 0) {
+    return nullptr;
+  }
+  if (size == 0) {
+    size++; // distinct blocks have distinct addresses
+  }
+
+  uintptr_t ptr = (arena->cursor + alignment - 1) & ~(alignment - 1);
+  if (arena->current == nullptr || ptr > arena->end || arena->end - ptr < size) {
+    if (!next_chunk(arena, size, alignment)) {
+      return nullptr;
+    }
+    ptr = (arena->cursor + alignment - 1) & ~(alignment - 1);
+  }
+  arena->cursor = ptr + size;
+  return reinterpret_cast<void *>(ptr);
+}
+
+void heaphook_arena_reset(heaphook_arena_t * arena)
+{
+  if (arena->first == nullptr) {
+    return;
+  }
+  use_chunk(arena, arena->first);
+}
+
+void heaphook_arena_destroy(heaphook_arena_t * arena)
+{
+  if (arena == nullptr) {
+    return;
+  }
+  ArenaChunk * chunk = arena->first;
+  while (chunk != nullptr) {
+    ArenaChunk * next = chunk->next;
+    GlobalAllocator::get_instance().dealloc(chunk);
+    chunk = next;
+  }
+  GlobalAllocator::get_instance().dealloc(arena);
+}
+
+} // extern "C"
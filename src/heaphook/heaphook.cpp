@@ -1,5 +1,6 @@
 #include "heaphook/heaphook.hpp"
 #include "heaphook/heaptracer.hpp"
+#include "heaphook/stack_table.hpp"
 #include "heaphook/utils.hpp"
 
 namespace heaphook
@@ -10,12 +11,16 @@ GlobalAllocator::GlobalAllocator() {}
 void * GlobalAllocator::alloc(size_t size, size_t align)
 {
   if constexpr (HeapTraceEnabled) {
+    size_t stack_id = 0;
+    if constexpr (HeapTraceBacktraceEnabled) {
+      stack_id = StackTable::getInstance().intern_current_stack();
+    }
     auto start_time = std::chrono::high_resolution_clock::now();
     auto retval = do_alloc(size, align);
     auto end_time = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time);
 
-    AllocInfo info {size, align, retval, static_cast<size_t>(duration.count())};
+    AllocInfo info {size, align, retval, static_cast<size_t>(duration.count()), stack_id};
     HeapTracer::getInstance().write_log(info);
     return retval;
   } else {
@@ -38,6 +43,21 @@ void GlobalAllocator::dealloc(void * ptr)
   }
 }
 
+void GlobalAllocator::dealloc_sized(void * ptr, size_t size, size_t align)
+{
+  if constexpr (HeapTraceEnabled) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    do_dealloc_sized(ptr, size, align);
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time);
+
+    DeallocInfo info {ptr, static_cast<size_t>(duration.count())};
+    HeapTracer::getInstance().write_log(info);
+  } else {
+    do_dealloc_sized(ptr, size, align);
+  }
+}
+
 size_t GlobalAllocator::get_block_size(void * ptr)
 {
   if constexpr (HeapTraceEnabled) {
@@ -57,12 +77,16 @@ size_t GlobalAllocator::get_block_size(void * ptr)
 void * GlobalAllocator::alloc_zeroed(size_t size)
 {
   if constexpr (HeapTraceEnabled) {
+    size_t stack_id = 0;
+    if constexpr (HeapTraceBacktraceEnabled) {
+      stack_id = StackTable::getInstance().intern_current_stack();
+    }
     auto start_time = std::chrono::high_resolution_clock::now();
     auto retval = do_alloc_zeroed(size);
     auto end_time = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time);
 
-    AllocZeroedInfo info {size, retval, static_cast<size_t>(duration.count())};
+    AllocZeroedInfo info {size, retval, static_cast<size_t>(duration.count()), stack_id};
     HeapTracer::getInstance().write_log(info);
     return retval;
   } else {
@@ -73,12 +97,16 @@ void * GlobalAllocator::alloc_zeroed(size_t size)
 void * GlobalAllocator::realloc(void * ptr, size_t new_size)
 {
   if constexpr (HeapTraceEnabled) {
+    size_t stack_id = 0;
+    if constexpr (HeapTraceBacktraceEnabled) {
+      stack_id = StackTable::getInstance().intern_current_stack();
+    }
     auto start_time = std::chrono::high_resolution_clock::now();
     auto retval = do_realloc(ptr, new_size);
     auto end_time = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time);
 
-    ReallocInfo info {ptr, new_size, retval, static_cast<size_t>(duration.count())};
+    ReallocInfo info {ptr, new_size, retval, static_cast<size_t>(duration.count()), stack_id};
     HeapTracer::getInstance().write_log(info);
     return retval;
   } else {
@@ -86,6 +114,43 @@ void * GlobalAllocator::realloc(void * ptr, size_t new_size)
   }
 }
 
+void * GlobalAllocator::realloc_sized(void * ptr, size_t old_size, size_t new_size)
+{
+  if constexpr (HeapTraceEnabled) {
+    size_t stack_id = 0;
+    if constexpr (HeapTraceBacktraceEnabled) {
+      stack_id = StackTable::getInstance().intern_current_stack();
+    }
+    auto start_time = std::chrono::high_resolution_clock::now();
+    auto retval = do_realloc_sized(ptr, old_size, new_size);
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time);
+
+    ReallocInfo info {ptr, new_size, retval, static_cast<size_t>(duration.count()), stack_id};
+    HeapTracer::getInstance().write_log(info);
+    return retval;
+  } else {
+    return do_realloc_sized(ptr, old_size, new_size);
+  }
+}
+
+int GlobalAllocator::trim(size_t pad)
+{
+  return do_trim(pad);
+}
+
+bool GlobalAllocator::get_stats(AllocatorStats & stats, bool detailed)
+{
+  return do_get_stats(stats, detailed);
+}
+
+void GlobalAllocator::do_dealloc_sized(void * ptr, size_t size, size_t align)
+{
+  (void)size;
+  (void)align;
+  do_dealloc(ptr);
+}
+
 void * GlobalAllocator::do_alloc_zeroed(size_t size)
 {
   auto retval = do_alloc(size, 1);
@@ -111,4 +176,23 @@ void * GlobalAllocator::do_realloc(void * ptr, size_t new_size)
   return retval;
 }
 
+void * GlobalAllocator::do_realloc_sized(void * ptr, size_t old_size, size_t new_size)
+{
+  (void)old_size;
+  return do_realloc(ptr, new_size);
+}
+
+int GlobalAllocator::do_trim(size_t pad)
+{
+  (void)pad;
+  return 0;
+}
+
+bool GlobalAllocator::do_get_stats(AllocatorStats & stats, bool detailed)
+{
+  (void)stats;
+  (void)detailed;
+  return false;
+}
+
 } // namespace heaphook
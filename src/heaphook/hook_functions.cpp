@@ -2,12 +2,27 @@
 #include <cstdlib>
 #include <cerrno>
 
+#include <new>
+
 #include "heaphook/heaphook.hpp"
 #include "heaphook/hook_types.hpp"
 #include "heaphook/utils.hpp"
 
 using namespace heaphook;
 
+// the library is preloaded, so the initial-exec model saves a __tls_get_addr call per access
+__attribute__((tls_model("initial-exec"))) static __thread const void * callsite = nullptr;
+
+namespace heaphook
+{
+
+const void * current_callsite()
+{
+  return callsite;
+}
+
+} // namespace heaphook
+
 static inline void * _int_malloc(size_t size)
 {
   if (size == 0) {
@@ -32,6 +47,21 @@ static inline void _int_free(void * ptr)
   return GlobalAllocator::get_instance().dealloc(ptr);
 }
 
+// free_sized and free_aligned_sized (C23). size must be the size ptr was allocated with,
+// so it is passed on to the allocator as a hint.
+static inline void _int_free_sized(void * ptr, size_t size, size_t alignment)
+{
+  if (ptr == nullptr) {
+    return;
+  }
+  if (size == 0) {
+    size++; // as allocated by _int_malloc and others
+  }
+
+  // ptr != nullptr && size > 0
+  GlobalAllocator::get_instance().dealloc_sized(ptr, size, alignment);
+}
+
 static inline void * _int_calloc(size_t num, size_t size)
 {
   size_t bytes;
@@ -160,10 +190,169 @@ static inline size_t _int_malloc_usable_size(void * ptr)
   return GlobalAllocator::get_instance().get_block_size(ptr);
 }
 
+static inline int _int_malloc_trim(size_t pad)
+{
+  return GlobalAllocator::get_instance().trim(pad);
+}
+
+template<class Info, class Field>
+static inline Info to_mallinfo(const AllocatorStats & stats)
+{
+  Info info{};
+  info.arena = static_cast<Field>(stats.mapped_bytes - stats.added_area_bytes);
+  info.hblks = static_cast<Field>(stats.num_added_areas);
+  info.hblkhd = static_cast<Field>(stats.added_area_bytes);
+  info.usmblks = static_cast<Field>(stats.peak_used_bytes);
+  info.uordblks = static_cast<Field>(
+    stats.used_bytes + stats.num_used_blocks * stats.block_overhead);
+  info.fordblks = static_cast<Field>(stats.free_bytes);
+  info.keepcost = 0; // there is no top chunk which trimming would release
+  return info;
+}
+
+#ifdef HAVE_MALLINFO2
+static inline struct mallinfo2 _int_mallinfo2()
+{
+  AllocatorStats stats;
+  if (!GlobalAllocator::get_instance().get_stats(stats, false)) {
+    static mallinfo2_type original_mallinfo2 =
+      reinterpret_cast<mallinfo2_type>(dlsym(RTLD_NEXT, "mallinfo2"));
+    return original_mallinfo2();
+  }
+  return to_mallinfo<struct mallinfo2, size_t>(stats);
+}
+#endif
+
+// this function is obsolete, the fields overflow beyond 2GB
+static inline struct mallinfo _int_mallinfo()
+{
+  AllocatorStats stats;
+  if (!GlobalAllocator::get_instance().get_stats(stats, false)) {
+    static mallinfo_type original_mallinfo =
+      reinterpret_cast<mallinfo_type>(dlsym(RTLD_NEXT, "mallinfo"));
+    return original_mallinfo();
+  }
+  return to_mallinfo<struct mallinfo, int>(stats);
+}
+
+static inline void _int_malloc_stats()
+{
+  AllocatorStats stats;
+  if (!GlobalAllocator::get_instance().get_stats(stats, true)) {
+    static malloc_stats_type original_malloc_stats =
+      reinterpret_cast<malloc_stats_type>(dlsym(RTLD_NEXT, "malloc_stats"));
+    original_malloc_stats();
+    return;
+  }
+  // printed without allocating, like glibc does
+  write_to_stderr(
+    "system bytes       = ", stats.mapped_bytes, "\n",
+    "in use bytes       = ", stats.used_bytes, "\n",
+    "free bytes         = ", stats.free_bytes, "\n",
+    "max in use bytes   = ", stats.peak_used_bytes, "\n",
+    "used blocks        = ", stats.num_used_blocks, "\n",
+    "block overhead     = ", stats.block_overhead, "\n",
+    "added areas        = ", stats.num_added_areas, "\n",
+    "added area bytes   = ", stats.added_area_bytes, "\n");
+}
+
+static inline int _int_malloc_info(int options, FILE * fp)
+{
+  if (options != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  AllocatorStats stats;
+  if (!GlobalAllocator::get_instance().get_stats(stats, true)) {
+    static malloc_info_type original_malloc_info =
+      reinterpret_cast<malloc_info_type>(dlsym(RTLD_NEXT, "malloc_info"));
+    return original_malloc_info(options, fp);
+  }
+  fprintf(
+    fp,
+    "<malloc version=\"heaphook-1\">\n"
+    "<total type=\"mapped\" size=\"%zu\"/>\n"
+    "<total type=\"used\" count=\"%zu\" size=\"%zu\"/>\n"
+    "<total type=\"free\" size=\"%zu\"/>\n"
+    "<total type=\"max_used\" size=\"%zu\"/>\n"
+    "<total type=\"overhead\" per_block=\"%zu\" size=\"%zu\"/>\n"
+    "<total type=\"added_areas\" count=\"%zu\" size=\"%zu\"/>\n"
+    "</malloc>\n",
+    stats.mapped_bytes, stats.num_used_blocks, stats.used_bytes,
+    stats.free_bytes, stats.peak_used_bytes,
+    stats.block_overhead, stats.num_used_blocks * stats.block_overhead,
+    stats.num_added_areas, stats.added_area_bytes);
+  return 0;
+}
+
+// operator new and delete call GlobalAllocator directly instead of going through malloc and free,
+// so that the alignment of aligned new and the size of sized delete reach the allocator.
+static inline size_t to_alignment(std::align_val_t al)
+{
+  size_t alignment = static_cast<size_t>(al);
+  if (alignment <= sizeof(void *)) {
+    return 1; // guaranteed by any allocation
+  }
+  return is_valid_alignment(alignment) ? alignment : next_power_of_2(alignment);
+}
+
+static inline void * _int_operator_new(size_t size, size_t alignment)
+{
+  if (size == 0) {
+    size++;
+  }
+  if (alignment == 0) { // alignment > 0x80000000'00000000
+    throw std::bad_alloc();
+  }
+
+  // as libstdc++ does, the new handler is called until it frees enough memory or throws
+  for (;;) {
+    void * ptr = GlobalAllocator::get_instance().alloc(size, alignment);
+    if (ptr != nullptr) {
+      return ptr;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+static inline void * _int_operator_new_nothrow(size_t size, size_t alignment) noexcept
+{
+  try {
+    return _int_operator_new(size, alignment);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+static inline void _int_operator_delete(void * ptr) noexcept
+{
+  if (ptr == nullptr) {
+    return;
+  }
+  GlobalAllocator::get_instance().dealloc(ptr);
+}
+
+static inline void _int_operator_delete_sized(void * ptr, size_t size, size_t alignment) noexcept
+{
+  if (ptr == nullptr) {
+    return;
+  }
+  if (size == 0) {
+    size++; // as allocated by _int_operator_new
+  }
+  GlobalAllocator::get_instance().dealloc_sized(ptr, size, alignment);
+}
+
 extern "C" {
 
 void * malloc(size_t size)
 {
+  callsite = __builtin_return_address(0);
   return _int_malloc(size);
 }
 
@@ -172,40 +361,57 @@ void free(void * ptr)
   _int_free(ptr);
 }
 
+void free_sized(void * ptr, size_t size)
+{
+  _int_free_sized(ptr, size, 1);
+}
+
+void free_aligned_sized(void * ptr, size_t alignment, size_t size)
+{
+  _int_free_sized(ptr, size, alignment);
+}
+
 void * calloc(size_t num, size_t size)
 {
+  callsite = __builtin_return_address(0);
   return _int_calloc(num, size);
 }
 
 
 void * realloc(void * ptr, size_t new_size)
 {
+  callsite = __builtin_return_address(0);
   return _int_realloc(ptr, new_size);
 }
 
 
 int posix_memalign(void ** memptr, size_t alignment, size_t size)
 {
+  callsite = __builtin_return_address(0);
   return _int_posix_memalign(memptr, alignment, size);
 }
 
 void * memalign(size_t alignment, size_t size)
 {
+  callsite = __builtin_return_address(0);
   return _int_memalign(alignment, size);
 }
 
 void * aligned_alloc(size_t alignment, size_t size)
 {
+  callsite = __builtin_return_address(0);
   return _int_aligned_alloc(alignment, size);
 }
 
 void * valloc(size_t size)
 {
+  callsite = __builtin_return_address(0);
   return _int_valloc(size);
 }
 
 void * pvalloc(size_t size)
 {
+  callsite = __builtin_return_address(0);
   return _int_pvalloc(size);
 }
 
@@ -214,4 +420,139 @@ size_t malloc_usable_size(void * ptr)
   return _int_malloc_usable_size(ptr);
 }
 
+int malloc_trim(size_t pad)
+{
+  return _int_malloc_trim(pad);
+}
+
+#ifdef HAVE_MALLINFO2
+struct mallinfo2 mallinfo2()
+{
+  return _int_mallinfo2();
+}
+#endif
+
+struct mallinfo mallinfo()
+{
+  return _int_mallinfo();
+}
+
+void malloc_stats()
+{
+  _int_malloc_stats();
+}
+
+int malloc_info(int options, FILE * fp)
+{
+  return _int_malloc_info(options, fp);
+}
+
 } // extern "C"
+
+void * operator new(size_t size)
+{
+  callsite = __builtin_return_address(0);
+  return _int_operator_new(size, 1);
+}
+
+void * operator new[](size_t size)
+{
+  callsite = __builtin_return_address(0);
+  return _int_operator_new(size, 1);
+}
+
+void * operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  callsite = __builtin_return_address(0);
+  return _int_operator_new_nothrow(size, 1);
+}
+
+void * operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+  callsite = __builtin_return_address(0);
+  return _int_operator_new_nothrow(size, 1);
+}
+
+void * operator new(size_t size, std::align_val_t al)
+{
+  callsite = __builtin_return_address(0);
+  return _int_operator_new(size, to_alignment(al));
+}
+
+void * operator new[](size_t size, std::align_val_t al)
+{
+  callsite = __builtin_return_address(0);
+  return _int_operator_new(size, to_alignment(al));
+}
+
+void * operator new(size_t size, std::align_val_t al, const std::nothrow_t &) noexcept
+{
+  callsite = __builtin_return_address(0);
+  return _int_operator_new_nothrow(size, to_alignment(al));
+}
+
+void * operator new[](size_t size, std::align_val_t al, const std::nothrow_t &) noexcept
+{
+  callsite = __builtin_return_address(0);
+  return _int_operator_new_nothrow(size, to_alignment(al));
+}
+
+void operator delete(void * ptr) noexcept
+{
+  _int_operator_delete(ptr);
+}
+
+void operator delete[](void * ptr) noexcept
+{
+  _int_operator_delete(ptr);
+}
+
+void operator delete(void * ptr, const std::nothrow_t &) noexcept
+{
+  _int_operator_delete(ptr);
+}
+
+void operator delete[](void * ptr, const std::nothrow_t &) noexcept
+{
+  _int_operator_delete(ptr);
+}
+
+void operator delete(void * ptr, size_t size) noexcept
+{
+  _int_operator_delete_sized(ptr, size, 1);
+}
+
+void operator delete[](void * ptr, size_t size) noexcept
+{
+  _int_operator_delete_sized(ptr, size, 1);
+}
+
+void operator delete(void * ptr, std::align_val_t) noexcept
+{
+  _int_operator_delete(ptr);
+}
+
+void operator delete[](void * ptr, std::align_val_t) noexcept
+{
+  _int_operator_delete(ptr);
+}
+
+void operator delete(void * ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+  _int_operator_delete(ptr);
+}
+
+void operator delete[](void * ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+  _int_operator_delete(ptr);
+}
+
+void operator delete(void * ptr, size_t size, std::align_val_t al) noexcept
+{
+  _int_operator_delete_sized(ptr, size, to_alignment(al));
+}
+
+void operator delete[](void * ptr, size_t size, std::align_val_t al) noexcept
+{
+  _int_operator_delete_sized(ptr, size, to_alignment(al));
+}
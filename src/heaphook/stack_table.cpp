@@ -0,0 +1,109 @@
+#include <sys/mman.h>
+
+#include <cstdlib>
+
+#include "heaphook/stack_table.hpp"
+
+namespace heaphook
+{
+
+static uint64_t hash_frames(const void * const * frames, int num_frames)
+{
+  // FNV-1a over the return addresses
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (int i = 0; i < num_frames; i++) {
+    hash ^= reinterpret_cast<uint64_t>(frames[i]);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+StackTable::StackTable()
+: entries_(nullptr), index_(nullptr), max_stacks_(kDefaultMaxStacks), num_stacks_(0)
+{
+  if (const char * env_p = getenv("HEAPTRACE_MAX_STACKS")) {
+    // the table needs a slot, and the ids of the stacks are 32-bit
+    size_t max_stacks = strtoull(env_p, nullptr, 10);
+    if (max_stacks < kMinMaxStacks || max_stacks > kMaxMaxStacks) {
+      write_to_stderr(
+        "\n[ heaphook::StackTable ] HEAPTRACE_MAX_STACKS must be between ", kMinMaxStacks,
+        " and ", kMaxMaxStacks, ", using ", kDefaultMaxStacks, ".\n");
+    } else {
+      max_stacks_ = max_stacks;
+    }
+  }
+
+  format(stacks_file_name_, "./heaplog_", getpid(), ".stacks");
+  stacks_file_fd_ = open(stacks_file_name_, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (stacks_file_fd_ == -1) {
+    write_to_stderr("\n[ heaphook::StackTable ] ERROR: failed to open stacks file.\n");
+    exit(-1);
+  }
+
+  // pages are committed on first touch, so the unused part of the table costs nothing.
+  void * entries = mmap(
+    nullptr, max_stacks_ * sizeof(Entry), PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  void * index = mmap(
+    nullptr, 2 * max_stacks_ * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (entries == MAP_FAILED || index == MAP_FAILED) {
+    write_to_stderr("\n[ heaphook::StackTable ] ERROR: failed to map stack table.\n");
+    exit(-1);
+  }
+  entries_ = reinterpret_cast<Entry *>(entries);
+  index_ = reinterpret_cast<uint32_t *>(index);
+}
+
+size_t StackTable::intern_current_stack()
+{
+  // backtrace() may allocate memory on its first call, which comes back here.
+  if (in_capture_) {
+    return 0;
+  }
+  in_capture_ = true;
+  void * frames[kMaxFrames];
+  int num_frames = backtrace(frames, kMaxFrames);
+  size_t stack_id = intern(frames, num_frames);
+  in_capture_ = false;
+  return stack_id;
+}
+
+size_t StackTable::intern(const void * const * frames, int num_frames)
+{
+  uint64_t hash = hash_frames(frames, num_frames);
+  size_t num_slots = 2 * max_stacks_;
+
+  std::unique_lock<std::mutex> lock(mtx_);
+  for (size_t slot = hash % num_slots; ; slot = (slot + 1) % num_slots) {
+    uint32_t id = index_[slot];
+    if (id == 0) {
+      if (num_stacks_ == max_stacks_) {
+        return 0;
+      }
+      Entry & entry = entries_[num_stacks_];
+      entry.hash = hash;
+      entry.num_frames = num_frames;
+      memcpy(entry.frames, frames, num_frames * sizeof(void *));
+      index_[slot] = static_cast<uint32_t>(++num_stacks_);
+
+      char header[0x40];
+      format(header, "stack ", num_stacks_, "\n");
+      write(stacks_file_fd_, header, strlen(header));
+      backtrace_symbols_fd(entry.frames, num_frames, stacks_file_fd_);
+      write(stacks_file_fd_, "\n", 1);
+      return num_stacks_;
+    }
+
+    const Entry & entry = entries_[id - 1];
+    if (entry.hash == hash && entry.num_frames == num_frames &&
+      memcmp(entry.frames, frames, num_frames * sizeof(void *)) == 0)
+    {
+      return id;
+    }
+  }
+}
+
+thread_local bool StackTable::in_capture_ = false;
+
+} // namespace heaphook
@@ -59,6 +59,13 @@ class OriginalAllocator : public GlobalAllocator
         "realloc"));
     return original_realloc(ptr, new_size);
   }
+
+  int do_trim(size_t pad) override
+  {
+    static malloc_trim_type original_malloc_trim =
+      reinterpret_cast<malloc_trim_type>(dlsym(RTLD_NEXT, "malloc_trim"));
+    return original_malloc_trim(pad);
+  }
 };
 
 GlobalAllocator & GlobalAllocator::get_instance()
@@ -0,0 +1,190 @@
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "callsite.hpp"
+
+#include "heaphook/utils.hpp"
+
+static constexpr int kResolving = 0; // being inserted, allocations go to the shared pool meanwhile
+static constexpr int kLearning = 1;
+static constexpr int kSegregated = 2;
+static constexpr int kShared = 3;
+
+static const char * basename_of(const char * path)
+{
+  const char * name = strrchr(path, '/');
+  return name ? name + 1 : path;
+}
+
+bool CallsiteClassifier::init(const char * sites_path)
+{
+  if (sites_path == nullptr) {
+    learning_ = true;
+    enabled_ = true;
+    return true;
+  }
+
+  // read without allocating, as this runs inside the first malloc
+  char buf[16 * 1024];
+  int fd = open(sites_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  size_t len = 0;
+  while (len + 1 < sizeof(buf)) {
+    ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+  }
+  close(fd);
+  buf[len] = '\0';
+
+  char * line = buf;
+  while (*line != '\0' && num_listed_sites_ < kMaxListedSites) {
+    char * next = strchr(line, '\n');
+    if (next == nullptr) {
+      next = line + strlen(line);
+    } else {
+      *next++ = '\0';
+    }
+    char * plus = strrchr(line, '+');
+    if (line[0] != '#' && plus != nullptr && static_cast<size_t>(plus - line) < kMaxObjectName) {
+      ListedSite & listed = listed_sites_[num_listed_sites_++];
+      memcpy(listed.object_name, line, plus - line);
+      listed.object_name[plus - line] = '\0';
+      listed.offset = strtoull(plus + 1, nullptr, 16);
+    }
+    line = next;
+  }
+  enabled_ = true;
+  return true;
+}
+
+bool CallsiteClassifier::segregated(const void * callsite, Site ** learning_site)
+{
+  *learning_site = nullptr;
+  Site * site = find_site(reinterpret_cast<uintptr_t>(callsite));
+  if (site == nullptr) {
+    return false;
+  }
+
+  int state = site->state.load(std::memory_order_acquire);
+  if (state == kLearning) {
+    *learning_site = site;
+  }
+  return state == kSegregated;
+}
+
+void CallsiteClassifier::allocated(Site * site, void * ptr)
+{
+  uint32_t count = site->num_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (count % kSampleInterval != 0) {
+    return;
+  }
+
+  if (count >= kMaxLearningAllocations) {
+    // the sampled blocks are rarely freed
+    site->state.store(kShared, std::memory_order_release);
+    return;
+  }
+
+  // a slot taken by another sample skips this one
+  Sample & sample = samples_[(reinterpret_cast<uintptr_t>(ptr) >> 4) & (kMaxSamples - 1)];
+  void * expected = nullptr;
+  void * claimed = reinterpret_cast<void *>(1);
+  if (!sample.ptr.compare_exchange_strong(expected, claimed, std::memory_order_acquire)) {
+    return;
+  }
+  sample.site = site;
+  sample.birth = count;
+  sample.ptr.store(ptr, std::memory_order_release);
+}
+
+void CallsiteClassifier::consume_sample(void * ptr)
+{
+  Sample & sample = samples_[(reinterpret_cast<uintptr_t>(ptr) >> 4) & (kMaxSamples - 1)];
+  if (sample.ptr.load(std::memory_order_acquire) != ptr) {
+    return;
+  }
+  Site * site = sample.site;
+  uint32_t lifetime = site->num_allocations.load(std::memory_order_relaxed) - sample.birth;
+  sample.ptr.store(nullptr, std::memory_order_release);
+
+  if (lifetime < kShortLifetime) {
+    site->num_short_lived.fetch_add(1, std::memory_order_relaxed);
+  }
+  uint32_t num_samples = site->num_samples.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (num_samples == kMinSamples) {
+    // 90% of the blocks are short-lived
+    uint32_t num_short_lived = site->num_short_lived.load(std::memory_order_relaxed);
+    site->state.store(
+      num_short_lived * 10 >= num_samples * 9 ? kSegregated : kShared, std::memory_order_release);
+  }
+}
+
+CallsiteClassifier::Site * CallsiteClassifier::find_site(uintptr_t address)
+{
+  // Fibonacci hashing, as return addresses share their low and high bits
+  size_t index = (address * 11400714819323198485ull) >> 52;
+  for (size_t probe = 0; probe < kMaxProbes; probe++) {
+    Site & site = sites_[(index + probe) & (kMaxSites - 1)];
+    uintptr_t site_address = site.address.load(std::memory_order_acquire);
+    if (site_address == address) {
+      return &site;
+    }
+    if (site_address != 0) {
+      continue;
+    }
+    if (site.address.compare_exchange_strong(site_address, address, std::memory_order_acq_rel)) {
+      site.state.store(classify_new_site(address), std::memory_order_release);
+      return &site;
+    }
+    if (site_address == address) {
+      return &site; // inserted by another thread meanwhile
+    }
+  }
+  return nullptr; // the table is full around the index, so the call site is not segregated
+}
+
+int CallsiteClassifier::classify_new_site(uintptr_t address) const
+{
+  if (learning_) {
+    return kLearning;
+  }
+
+  Dl_info info;
+  if (dladdr(reinterpret_cast<void *>(address), &info) == 0 || info.dli_fname == nullptr) {
+    return kShared;
+  }
+  const char * object_name = basename_of(info.dli_fname);
+  uintptr_t offset = address - reinterpret_cast<uintptr_t>(info.dli_fbase);
+  for (size_t i = 0; i < num_listed_sites_; i++) {
+    if (listed_sites_[i].offset == offset && strcmp(listed_sites_[i].object_name, object_name) == 0) {
+      return kSegregated;
+    }
+  }
+  return kShared;
+}
+
+void CallsiteClassifier::report() const
+{
+  for (size_t i = 0; i < kMaxSites; i++) {
+    const Site & site = sites_[i];
+    uintptr_t address = site.address.load(std::memory_order_acquire);
+    if (address == 0 || site.state.load(std::memory_order_acquire) != kSegregated) {
+      continue;
+    }
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void *>(address), &info) == 0 || info.dli_fname == nullptr) {
+      continue;
+    }
+    void * offset = reinterpret_cast<void *>(address - reinterpret_cast<uintptr_t>(info.dli_fbase));
+    write_to_stderr(basename_of(info.dli_fname), "+", offset, "\n");
+  }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// This class decides which call sites of the allocation functions get their blocks from a
+// separate pool, so that short-lived blocks do not fragment the pool of long-lived ones.
+//
+// The call sites are either listed in a file, one "<object name>+0x<offset>" per line, or learned:
+// one in kSampleInterval allocations of each new call site is sampled, and its lifetime is
+// measured in the number of allocations the call site made until the block was freed.
+// A call site whose sampled blocks are mostly short-lived is segregated, and one whose blocks are
+// mostly long-lived or rarely freed is not. Sampling stops once a call site is classified.
+//
+// this class designed with singlton design pattern.
+class CallsiteClassifier
+{
+public:
+  struct Site
+  {
+    std::atomic<uintptr_t> address{0}; // 0: unused
+    std::atomic<int> state{0};
+    std::atomic<uint32_t> num_allocations{0};
+    std::atomic<uint32_t> num_samples{0};
+    std::atomic<uint32_t> num_short_lived{0};
+  };
+
+private:
+  static constexpr size_t kMaxSites = 4096; // power of 2
+  static constexpr size_t kMaxProbes = 16;
+  static constexpr size_t kMaxSamples = 1024; // power of 2
+  static constexpr uint32_t kSampleInterval = 16;
+  static constexpr uint32_t kShortLifetime = 256; // allocations of the call site
+  static constexpr uint32_t kMinSamples = 32;
+  static constexpr uint32_t kMaxLearningAllocations = 8192;
+  static constexpr size_t kMaxListedSites = 256;
+  static constexpr size_t kMaxObjectName = 64;
+
+  struct Sample
+  {
+    std::atomic<void *> ptr{nullptr};
+    Site * site = nullptr;
+    uint32_t birth = 0;
+  };
+
+  struct ListedSite
+  {
+    char object_name[kMaxObjectName] = {};
+    uintptr_t offset = 0;
+  };
+
+  bool enabled_ = false;
+  bool learning_ = false;
+  Site sites_[kMaxSites];
+  Sample samples_[kMaxSamples];
+  ListedSite listed_sites_[kMaxListedSites];
+  size_t num_listed_sites_ = 0;
+
+  constexpr CallsiteClassifier() {}
+
+public:
+  CallsiteClassifier(const CallsiteClassifier &) = delete;
+  void operator=(const CallsiteClassifier &) = delete;
+  CallsiteClassifier(CallsiteClassifier &&) = delete;
+  void operator=(CallsiteClassifier &&) = delete;
+
+  static CallsiteClassifier & getInstance()
+  {
+    // constant-initialized, so it can be used before any constructor runs
+    static CallsiteClassifier classifier;
+    return classifier;
+  }
+
+  // reads the call sites to segregate from sites_path, or learns them if sites_path is nullptr.
+  // called once before any other member function. returns false if sites_path cannot be read.
+  bool init(const char * sites_path);
+
+  bool enabled() const
+  {
+    return enabled_;
+  }
+
+  // returns whether the blocks of callsite go to the separate pool.
+  // *learning_site is set to the site to pass to allocated() if the call site is being learned,
+  // and to nullptr otherwise.
+  bool segregated(const void * callsite, Site ** learning_site);
+
+  // called with a block allocated for a call site being learned.
+  void allocated(Site * site, void * ptr);
+
+  // called with every block freed or moved by realloc.
+  void deallocated(void * ptr)
+  {
+    if (learning_) {
+      consume_sample(ptr);
+    }
+  }
+
+  // writes the segregated call sites to stderr in the format of the file.
+  void report() const;
+
+private:
+  Site * find_site(uintptr_t address);
+  int classify_new_site(uintptr_t address) const;
+  void consume_sample(void * ptr);
+};
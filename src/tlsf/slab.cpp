@@ -0,0 +1,164 @@
+#include "slab.hpp"
+
+static constexpr int kUnregistered = 0;
+static constexpr int kRegistered = 1;
+static constexpr int kExited = 2; // the magazines have been flushed by the key destructor
+
+__attribute__((tls_model("initial-exec")))
+thread_local SlabAllocator::Magazine SlabAllocator::magazines_[SlabAllocator::kNumClasses];
+__attribute__((tls_model("initial-exec")))
+thread_local int SlabAllocator::thread_state_ = kUnregistered;
+
+void SlabAllocator::init(char * arena, size_t size, const pthread_mutexattr_t * mutex_attr)
+{
+  // the size classes of the slabs are kept in the first slabs of the arena
+  size_t num_slabs = size / kSlabSize;
+  size_t num_metadata_slabs = (num_slabs + kSlabSize - 1) / kSlabSize;
+  if (num_slabs <= num_metadata_slabs) {
+    return;
+  }
+
+  if (pthread_key_create(&thread_key_, flush_thread) != 0) {
+    return;
+  }
+  for (size_t cls = 0; cls < kNumClasses; cls++) {
+    pthread_mutex_init(&classes_[cls].mtx, mutex_attr);
+  }
+  slab_classes_ = reinterpret_cast<uint8_t *>(arena);
+  num_slabs_ = num_slabs;
+  num_assigned_slabs_.store(num_metadata_slabs, std::memory_order_relaxed);
+  arena_end_ = arena + num_slabs * kSlabSize;
+  arena_begin_ = arena;
+}
+
+void * SlabAllocator::alloc(size_t size)
+{
+  size_t cls = (size - 1) / kClassGranularity;
+
+  if (thread_state_ == kRegistered) {
+    Magazine & magazine = magazines_[cls];
+    if (magazine.count > 0) {
+      return magazine.objects[--magazine.count];
+    }
+    return refill(cls, magazine);
+  }
+
+  if (thread_state_ == kUnregistered) {
+    register_thread();
+    return alloc(size);
+  }
+
+  // an exiting thread bypasses its magazines, which are not flushed again
+  void * object = nullptr;
+  pthread_mutex_lock(&classes_[cls].mtx);
+  take(cls, &object, 1);
+  pthread_mutex_unlock(&classes_[cls].mtx);
+  return object;
+}
+
+void SlabAllocator::dealloc(void * ptr)
+{
+  size_t slab = (static_cast<char *>(ptr) - arena_begin_) / kSlabSize;
+  size_t cls = slab_classes_[slab];
+
+  if (thread_state_ == kRegistered) {
+    Magazine & magazine = magazines_[cls];
+    if (magazine.count == kMagazineSize) {
+      flush(cls, magazine, kMagazineSize / 2);
+    }
+    magazine.objects[magazine.count++] = ptr;
+    return;
+  }
+
+  if (thread_state_ == kUnregistered) {
+    register_thread();
+    dealloc(ptr);
+    return;
+  }
+
+  pthread_mutex_lock(&classes_[cls].mtx);
+  give(cls, &ptr, 1);
+  pthread_mutex_unlock(&classes_[cls].mtx);
+}
+
+// takes up to count objects of the class, first from the free list and then from the slabs.
+// the caller holds the lock of the class.
+size_t SlabAllocator::take(size_t cls, void ** objects, size_t count)
+{
+  SizeClass & size_class = classes_[cls];
+  size_t num_taken = 0;
+  while (num_taken < count && size_class.free_list != nullptr) {
+    objects[num_taken++] = size_class.free_list;
+    size_class.free_list = *reinterpret_cast<void **>(size_class.free_list);
+  }
+
+  size_t object_size = (cls + 1) * kClassGranularity;
+  while (num_taken < count) {
+    if (size_class.unused_begin == size_class.unused_end) {
+      if (num_assigned_slabs_.load(std::memory_order_relaxed) >= num_slabs_) {
+        break;
+      }
+      size_t slab = num_assigned_slabs_.fetch_add(1, std::memory_order_relaxed);
+      if (slab >= num_slabs_) {
+        break;
+      }
+      slab_classes_[slab] = static_cast<uint8_t>(cls);
+      size_class.unused_begin = arena_begin_ + slab * kSlabSize;
+      size_class.unused_end = size_class.unused_begin + kSlabSize / object_size * object_size;
+    }
+    objects[num_taken++] = size_class.unused_begin;
+    size_class.unused_begin += object_size;
+  }
+  return num_taken;
+}
+
+// the caller holds the lock of the class.
+void SlabAllocator::give(size_t cls, void * const * objects, size_t count)
+{
+  SizeClass & size_class = classes_[cls];
+  for (size_t i = 0; i < count; i++) {
+    *reinterpret_cast<void **>(objects[i]) = size_class.free_list;
+    size_class.free_list = objects[i];
+  }
+}
+
+void * SlabAllocator::refill(size_t cls, Magazine & magazine)
+{
+  pthread_mutex_lock(&classes_[cls].mtx);
+  size_t num_taken = take(cls, magazine.objects, kMagazineSize / 2);
+  pthread_mutex_unlock(&classes_[cls].mtx);
+
+  if (num_taken == 0) {
+    return nullptr; // the arena is exhausted
+  }
+  magazine.count = num_taken - 1;
+  return magazine.objects[num_taken - 1];
+}
+
+void SlabAllocator::flush(size_t cls, Magazine & magazine, size_t count)
+{
+  pthread_mutex_lock(&classes_[cls].mtx);
+  give(cls, &magazine.objects[magazine.count - count], count);
+  pthread_mutex_unlock(&classes_[cls].mtx);
+  magazine.count -= count;
+}
+
+void SlabAllocator::register_thread()
+{
+  // set first, since pthread_setspecific may allocate
+  thread_state_ = kRegistered;
+  pthread_setspecific(thread_key_, this);
+}
+
+// the destructor of thread_key_, which returns the magazines of an exiting thread
+void SlabAllocator::flush_thread(void * self)
+{
+  SlabAllocator * slab_allocator = static_cast<SlabAllocator *>(self);
+  for (size_t cls = 0; cls < kNumClasses; cls++) {
+    Magazine & magazine = magazines_[cls];
+    if (magazine.count > 0) {
+      slab_allocator->flush(cls, magazine, magazine.count);
+    }
+  }
+  thread_state_ = kExited;
+}
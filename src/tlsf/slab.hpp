@@ -0,0 +1,108 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// This class serves small objects (up to kMaxSize bytes) in front of the TLSF heaps.
+//
+// An arena allocated from the TLSF pool is divided into slabs of kSlabSize bytes, and each slab
+// is handed to one size class (multiples of 16 bytes) when the class runs out of objects.
+// Objects carry no header: the size class of an object is looked up from the slab it lies in,
+// so the block size is known in O(1).
+//
+// Each thread keeps a magazine of free objects per size class, so most allocations and
+// deallocations touch no lock. A magazine exchanges half of its capacity with the central free
+// list of the class at once, which keeps every operation bounded.
+// Slabs are never returned to the TLSF pool.
+//
+// this class designed with singlton design pattern.
+class SlabAllocator
+{
+public:
+  static constexpr size_t kMaxSize = 256;
+  static constexpr size_t kSlabSize = 64 * 1024;
+
+private:
+  static constexpr size_t kClassGranularity = 16;
+  static constexpr size_t kNumClasses = kMaxSize / kClassGranularity;
+  static constexpr size_t kMagazineSize = 32;
+
+  struct SizeClass
+  {
+    pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+    void * free_list = nullptr; // linked through the first word of the objects
+    char * unused_begin = nullptr; // not yet carved part of the current slab
+    char * unused_end = nullptr;
+  };
+
+  struct Magazine
+  {
+    size_t count;
+    void * objects[kMagazineSize];
+  };
+
+  char * arena_begin_ = nullptr;
+  char * arena_end_ = nullptr;
+  uint8_t * slab_classes_ = nullptr; // size class of each slab
+  size_t num_slabs_ = 0;
+  std::atomic<size_t> num_assigned_slabs_{0};
+  pthread_key_t thread_key_ = 0;
+  SizeClass classes_[kNumClasses];
+
+  // the library is preloaded, so the initial-exec model saves a __tls_get_addr call per access
+  __attribute__((tls_model("initial-exec"))) thread_local static Magazine magazines_[kNumClasses];
+  __attribute__((tls_model("initial-exec"))) thread_local static int thread_state_;
+
+  constexpr SlabAllocator() {}
+
+public:
+  SlabAllocator(const SlabAllocator &) = delete;
+  void operator=(const SlabAllocator &) = delete;
+  SlabAllocator(SlabAllocator &&) = delete;
+  void operator=(SlabAllocator &&) = delete;
+
+  static SlabAllocator & getInstance()
+  {
+    // constant-initialized, so it can be used before any constructor runs
+    static SlabAllocator slab_allocator;
+    return slab_allocator;
+  }
+
+  // carves the slabs from [arena, arena + size), and initializes the locks with mutex_attr.
+  // arena must be aligned to 16 bytes. called once before any other member function.
+  void init(char * arena, size_t size, const pthread_mutexattr_t * mutex_attr);
+
+  bool enabled() const
+  {
+    return arena_begin_ != nullptr;
+  }
+
+  bool contains(const void * ptr) const
+  {
+    return ptr >= arena_begin_ && ptr < arena_end_;
+  }
+
+  // 0 < size <= kMaxSize. returns nullptr when the arena is exhausted.
+  void * alloc(size_t size);
+
+  // ptr is in the arena.
+  void dealloc(void * ptr);
+
+  // ptr is in the arena.
+  size_t get_block_size(const void * ptr) const
+  {
+    size_t slab = (static_cast<const char *>(ptr) - arena_begin_) / kSlabSize;
+    return (slab_classes_[slab] + 1) * kClassGranularity;
+  }
+
+private:
+  size_t take(size_t cls, void ** objects, size_t count);
+  void give(size_t cls, void * const * objects, size_t count);
+  void * refill(size_t cls, Magazine & magazine);
+  void flush(size_t cls, Magazine & magazine, size_t count);
+  void register_thread();
+  static void flush_thread(void * self);
+};
@@ -1,136 +1,2303 @@
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <string.h>
 #include <malloc.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <atomic>
 #include <cstdint>
-#include <unordered_map>
 #include <string>
 
-#include "tlsf/tlsf.h"
+#include "tlsf/tlsf.h"
+#include "slab.hpp"
+#include "callsite.hpp"
+
+#include "heaphook/heaphook.hpp"
+#include "heaphook/hook_types.hpp"
+#include "heaphook/utils.hpp"
+
+static char * mempool_ptr;
+static size_t INITIAL_MEMPOOL_SIZE = 100 * 1000 * 1000; // default: 100MB
+static size_t ADDITIONAL_MEMPOOL_SIZE = 100 * 1000 * 1000; // default: 100MB
+static size_t NUM_THREAD_HEAPS = 1; // default: all threads share one heap
+static size_t NUM_HEAPS = 1; // the thread heaps and the call site heap
+
+// How the pages of the memory pool are faulted in (TLSF_PREFAULT).
+enum class PrefaultPolicy
+{
+  Lazy, // "lazy": pages are faulted in on first touch
+  Sync, // "sync": pages are populated before they are used, as the pool was memset before
+  Populate, // "populate": pages are populated by the maintenance thread in the background
+  Lock, // "mlock": pages are populated and locked in memory before they are used
+};
+static PrefaultPolicy PREFAULT_POLICY = PrefaultPolicy::Sync;
+
+// Which pages back the memory pool (TLSF_HUGEPAGE).
+enum class HugePagePolicy
+{
+  Off, // "off": base pages
+  Transparent, // "thp": transparent huge pages requested with madvise(MADV_HUGEPAGE)
+  Huge2M, // "2M": MAP_HUGETLB with 2MB pages
+  Huge1G, // "1G": MAP_HUGETLB with 1GB pages
+};
+static HugePagePolicy HUGEPAGE_POLICY = HugePagePolicy::Off;
+static bool VERBOSE = false; // TLSF_VERBOSE=1 reports what the memory pool does
+
+// Returning free memory to the OS (TLSF_RELEASE_THRESHOLD, TLSF_RELEASE_ADVICE).
+// Once more than RELEASE_THRESHOLD bytes of a heap have been freed since its last release,
+// the maintenance thread gives the pages inside its free blocks back to the OS.
+// 0 disables it, while malloc_trim always works.
+static size_t RELEASE_THRESHOLD = 0;
+static int RELEASE_ADVICE = MADV_DONTNEED;
+static constexpr long RELEASE_CHECK_INTERVAL_NS = 100 * 1000 * 1000; // 100ms
+
+// When the free bytes of a heap fall below LOW_WATERMARK (TLSF_LOW_WATERMARK),
+// the maintenance thread adds an area to it ahead of demand. 0 disables it.
+static size_t LOW_WATERMARK = 0;
+
+// Objects up to SlabAllocator::kMaxSize bytes are served from slabs carved from an arena of
+// SLAB_ARENA_SIZE bytes (TLSF_SLAB_ARENA_SIZE) taken from the first heap. 0 disables it.
+static size_t SLAB_ARENA_SIZE = 0;
+
+// A block freed by a thread which does not own its heap, or while the heap is locked, is pushed
+// onto a lock-free list of the heap and freed in a batch by the next thread holding the lock,
+// so that free never waits for the lock (TLSF_REMOTE_FREE=on|off).
+static bool REMOTE_FREE = true;
+
+// What an allocation does when its heap is exhausted (TLSF_ON_EXHAUSTION).
+enum class ExhaustionPolicy
+{
+  Grow, // "grow": an area is mapped and added to the heap
+  Fail, // "enomem": the allocation fails with ENOMEM
+  Abort, // "abort": the process is aborted with the state of the heap
+};
+static ExhaustionPolicy EXHAUSTION_POLICY = ExhaustionPolicy::Grow;
+
+// Hard real-time mode (HEAPHOOK_RT=1). Allocations and deallocations take a bounded time and make
+// no system call unless a priority-inheritance lock is contended: the heaps are locked with
+// priority-inheritance mutexes, the whole process is mlockall'd, the pool never grows, and every
+// free is done by the freeing thread itself, as draining deferred frees has no bound.
+static bool REALTIME = false;
+static std::atomic<size_t> num_failed_allocations{0}; // reported by the maintenance thread
+
+// Blocks allocated by malloc and calloc from the call sites chosen by CallsiteClassifier go to a
+// separate heap of CALLSITE_POOL_SIZE bytes (TLSF_CALLSITE_POOL_SIZE), mapped apart from the initial
+// pool. The call sites are listed in CALLSITE_FILE (TLSF_CALLSITE_FILE) or learned. 0 disables it.
+static size_t CALLSITE_POOL_SIZE = 0;
+static const char * CALLSITE_FILE = nullptr;
+
+// Threads listed in TLSF_THREAD_POOLS, as "<thread name or TID>=<bytes>,...", allocate from a
+// dedicated heap of that size, mapped and prefaulted apart from the initial pool, so that e.g. a
+// control loop does not share its lock with logging threads. Threads of the same name share the
+// heap. A thread looks its heap up on its first allocation, and again on the next allocation
+// after it is renamed with pthread_setname_np. Renames with prctl(PR_SET_NAME) or by writing
+// /proc/<pid>/task/<tid>/comm are not seen.
+static constexpr size_t MAX_THREAD_POOLS = 8;
+struct ThreadPool
+{
+  char name[16]; // the longest name of a thread is 15 characters
+  pid_t tid; // 0: matched by name
+  size_t size;
+  char * pool;
+  struct Heap * heap;
+};
+static ThreadPool thread_pools[MAX_THREAD_POOLS];
+static size_t num_thread_pools = 0;
+
+// Threads renamed by another thread, which look their heap up again on their next allocation.
+// The other threads only load the count, so renaming a thread costs the others no system call.
+static constexpr size_t MAX_RENAMED_THREADS = 16;
+static std::atomic<pthread_t> renamed_threads[MAX_RENAMED_THREADS]; // 0: unused
+static std::atomic<size_t> num_renamed_threads{0}; // at least the used entries
+
+// Blocks of MMAP_THRESHOLD bytes or more (TLSF_MMAP_THRESHOLD) are not taken from the pool but
+// get a mapping of their own, which realloc resizes with mremap(MREMAP_MAYMOVE), so that growing
+// a large buffer moves page tables instead of copying it. 0 disables it, and so does HEAPHOOK_RT=1.
+static size_t MMAP_THRESHOLD = 0;
+static std::atomic<size_t> large_mapped_bytes{0};
+static std::atomic<size_t> num_large_blocks{0};
+
+// Up to MMAP_CACHE_SIZE bytes (TLSF_MMAP_CACHE_SIZE) of freed large blocks stay mapped and are
+// handed out again for about the same size, so that buffers allocated and freed every cycle
+// cause no mmap, munmap or page fault once warmed up. 0 disables it.
+static size_t MMAP_CACHE_SIZE = 0;
+
+// Learning the initial pool size across runs (TLSF_PROFILE_DIR, TLSF_PROFILE_MARGIN).
+// At exit, the pool size the run needed is recorded in a profile file per executable in
+// TLSF_PROFILE_DIR, and the next run starts with the largest recorded size plus
+// PROFILE_MARGIN_PERCENT, unless INITIAL_MEMPOOL_SIZE is given.
+static char PROFILE_PATH[PATH_MAX]; // empty: disabled
+static size_t PROFILE_MARGIN_PERCENT = 25;
+static constexpr size_t MIN_PROFILED_HEAP_SIZE = 1024 * 1024;
+
+static pthread_mutex_t init_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t init_cond = PTHREAD_COND_INITIALIZER; // mempool_initialized == true
+static bool mempool_initialized = false;
+static bool mempool_init_started = false; // guarded by init_mtx
+
+// Ranges of a heap which are known to be zero, as they have never been handed out since they
+// were mapped or released with MADV_DONTNEED, so that calloc can skip clearing them.
+// Ranges which do not fit are forgotten, which only costs a memset.
+struct CleanRange
+{
+  char * begin;
+  char * end;
+};
+
+static constexpr size_t MAX_CLEAN_RANGES = 32;
+
+struct CleanRanges
+{
+  CleanRange ranges[MAX_CLEAN_RANGES];
+  size_t count;
+};
+
+// Each heap is an independent TLSF pool protected by its own lock.
+// The initial memory pool is split evenly into NUM_THREAD_HEAPS heaps and threads are
+// assigned to them in a round-robin manner, so threads on different heaps never contend.
+// A block is always returned to (and resized in) the heap it was allocated from.
+struct Heap
+{
+  pthread_mutex_t mtx;
+  char * pool; // passed to the *_ex functions of the tlsf library
+  char * first_buffer; // buffer of the first block of the initial slice
+  size_t mapped_bytes; // guarded by mtx
+  size_t used_bytes; // guarded by mtx
+  size_t freed_bytes; // since the last release, guarded by mtx
+  size_t peak_block_bytes; // peak of the used bytes plus the block headers, guarded by mtx
+  size_t num_used_blocks; // guarded by mtx
+  std::atomic<bool> release_requested;
+  std::atomic<bool> grow_requested;
+  std::atomic<void *> remote_frees; // blocks linked through their first word
+  std::atomic<size_t> num_threads; // threads allocating from the heap, which drain remote_frees
+  CleanRanges clean; // guarded by mtx
+};
+
+static constexpr size_t MAX_THREAD_HEAPS = 64;
+// followed by the call site heap and the heaps of TLSF_THREAD_POOLS
+static Heap heaps[MAX_THREAD_HEAPS + 1 + MAX_THREAD_POOLS];
+static Heap * callsite_heap = nullptr;
+static char * callsite_pool = nullptr;
+static size_t heap_slice_size;
+static std::atomic<size_t> num_assigned_threads{0};
+static __thread Heap * thread_heap = nullptr;
+static __thread bool thread_heap_left = false; // the thread is exiting, and no longer counted
+static pthread_key_t thread_heap_key; // its destructor runs when a thread exits
+static __thread bool thread_heap_dedicated = false; // a heap of TLSF_THREAD_POOLS
+static __thread bool thread_heap_looked_up = false; // since the thread was last renamed
+
+// The areas added to the heaps when they are exhausted.
+// Entries are only appended, and published by incrementing num_areas.
+// The last page of an area is not handed to the tlsf library, so that areas which happen to be
+// adjacent are never merged and the blocks of each area can be walked on their own.
+struct Area
+{
+  char * begin;
+  char * end;
+  Heap * heap;
+  size_t page_size;
+};
+
+static constexpr size_t MAX_AREAS = 4096;
+static Area areas[MAX_AREAS];
+static std::atomic<size_t> num_areas{0};
+static pthread_mutex_t area_mtx = PTHREAD_MUTEX_INITIALIZER;
+static size_t mempool_page_size;
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23 // since Linux 5.14
+#endif
+
+static size_t get_rss_bytes()
+{
+  int fd = open("/proc/self/statm", O_RDONLY);
+  if (fd == -1) {
+    return 0;
+  }
+  char buf[0x100];
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return 0;
+  }
+  buf[len] = '\0';
+
+  // the second field is the number of resident pages
+  char * resident = strchr(buf, ' ');
+  if (resident == nullptr) {
+    return 0;
+  }
+  return strtoull(resident, nullptr, 10) * sysconf(_SC_PAGESIZE);
+}
+
+static void populate_region(char * addr, size_t size)
+{
+  if (madvise(addr, size, MADV_POPULATE_WRITE) == 0) {
+    return;
+  }
+
+  // Older kernels: take a write fault on every page without changing its contents,
+  // since the region may already be in use.
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  for (size_t offset = 0; offset < size; offset += page_size) {
+    __atomic_fetch_add(addr + offset, 0, __ATOMIC_RELAXED);
+  }
+}
+
+// The maintenance thread works on the memory pool off the allocation path.
+struct Region
+{
+  char * addr;
+  size_t size;
+  size_t populated_size;
+  size_t duration_ns;
+};
+
+// regions are populated in chunks, so that pool growth is never delayed for long
+static constexpr size_t POPULATE_CHUNK_SIZE = 16 * 1024 * 1024;
+
+static pthread_mutex_t maintenance_mtx = PTHREAD_MUTEX_INITIALIZER;
+static constexpr size_t MAX_PENDING_PREFAULTS = 64;
+static Region pending_prefaults[MAX_PENDING_PREFAULTS]; // guarded by maintenance_mtx
+static size_t num_pending_prefaults = 0; // guarded by maintenance_mtx
+
+// 1 when the maintenance thread has work to look at. it is a futex word, so that the
+// allocation path wakes the thread up without taking a lock.
+static std::atomic<int> maintenance_requested{0};
+static_assert(sizeof(std::atomic<int>) == sizeof(int), "maintenance_requested is a futex word");
+
+// set in the child of fork, which has no maintenance thread until its next allocation
+static std::atomic<bool> maintenance_thread_lost{false};
+
+// Messages from the allocation path are passed to the maintenance thread through a fixed-size
+// lock-free ring, so that an allocating thread never formats nor writes them itself.
+struct PoolEvent
+{
+  std::atomic<size_t> sequence;
+  size_t area_size;
+  size_t page_size; // 0 when the area could not be mapped
+};
+
+static constexpr size_t MAX_POOL_EVENTS = 64; // power of 2
+static PoolEvent pool_events[MAX_POOL_EVENTS];
+static std::atomic<size_t> pool_events_tail{0};
+static size_t pool_events_head = 0; // only used by the maintenance thread
+static std::atomic<size_t> num_dropped_events{0};
+
+static void init_pool_events()
+{
+  for (size_t i = 0; i < MAX_POOL_EVENTS; i++) {
+    pool_events[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+static void wake_maintenance_thread()
+{
+  // only the first request since the thread last looked needs a wake-up
+  if (maintenance_requested.exchange(1, std::memory_order_acq_rel) == 0) {
+    syscall(
+      SYS_futex, reinterpret_cast<int *>(&maintenance_requested), FUTEX_WAKE_PRIVATE, 1,
+      nullptr, nullptr, 0);
+  }
+}
+
+static void post_pool_event(size_t area_size, size_t page_size)
+{
+  size_t pos = pool_events_tail.load(std::memory_order_relaxed);
+  while (true) {
+    PoolEvent & event = pool_events[pos & (MAX_POOL_EVENTS - 1)];
+    size_t sequence = event.sequence.load(std::memory_order_acquire);
+    if (sequence == pos) {
+      if (pool_events_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        event.area_size = area_size;
+        event.page_size = page_size;
+        event.sequence.store(pos + 1, std::memory_order_release);
+        break;
+      }
+    } else if (sequence < pos) {
+      num_dropped_events.fetch_add(1, std::memory_order_relaxed); // full
+      break;
+    } else {
+      pos = pool_events_tail.load(std::memory_order_relaxed);
+    }
+  }
+  wake_maintenance_thread();
+}
+
+static void report_pool_events()
+{
+  while (true) {
+    PoolEvent & event = pool_events[pool_events_head & (MAX_POOL_EVENTS - 1)];
+    if (event.sequence.load(std::memory_order_acquire) != pool_events_head + 1) {
+      break;
+    }
+    if (event.page_size == 0) {
+      write_to_stderr(
+        "TLSF memory pool exhausted: failed to map ", event.area_size, " bytes.\n");
+    } else {
+      write_to_stderr(
+        "TLSF memory pool exhausted: ", event.area_size, " bytes additionally mmaped (",
+        event.page_size, "-byte pages).\n");
+    }
+    event.sequence.store(pool_events_head + MAX_POOL_EVENTS, std::memory_order_release);
+    pool_events_head++;
+  }
+
+  if (size_t num_dropped = num_dropped_events.exchange(0, std::memory_order_relaxed)) {
+    write_to_stderr("TLSF memory pool: ", num_dropped, " more messages dropped.\n");
+  }
+}
+
+static void report_failed_allocations()
+{
+  if (size_t num_failed = num_failed_allocations.exchange(0, std::memory_order_relaxed)) {
+    write_to_stderr(
+      "TLSF memory pool exhausted: ", num_failed, " allocations failed with ENOMEM.\n");
+  }
+}
+
+static size_t release_free_pages(Heap * heap, size_t pad);
+static void init_clean_ranges(Heap * heap);
+static void take_clean_ranges(Heap * heap, void * block_ptr, CleanRanges * taken);
+static void grow_heap(Heap * heap);
+
+static void do_maintenance()
+{
+  report_pool_events();
+  report_failed_allocations();
+  for (size_t i = 0; i < NUM_HEAPS; i++) {
+    if (heaps[i].grow_requested.load(std::memory_order_relaxed)) {
+      grow_heap(&heaps[i]);
+      heaps[i].grow_requested.store(false, std::memory_order_relaxed);
+    }
+    if (heaps[i].release_requested.exchange(false, std::memory_order_relaxed)) {
+      release_free_pages(&heaps[i], 0);
+    }
+  }
+}
+
+// returns right away if the thread was woken up since it last looked at its work
+static void wait_for_maintenance()
+{
+  // release requests and failed allocations are polled, so that neither free nor a failing
+  // allocation wakes this thread up
+  struct timespec timeout = {0, RELEASE_CHECK_INTERVAL_NS};
+  bool poll = RELEASE_THRESHOLD > 0 || EXHAUSTION_POLICY == ExhaustionPolicy::Fail;
+  syscall(
+    SYS_futex, reinterpret_cast<int *>(&maintenance_requested), FUTEX_WAIT_PRIVATE, 0,
+    poll ? &timeout : nullptr, nullptr, 0);
+}
+
+static void * maintenance_main(void *)
+{
+  // named by itself, so that no other thread looks its heap up again (see pthread_setname_np)
+  pthread_setname_np(pthread_self(), "heaphook_tlsf");
+  while (true) {
+    // acquires the requests made before the wake-up
+    maintenance_requested.exchange(0, std::memory_order_acq_rel);
+    do_maintenance();
+
+    pthread_mutex_lock(&maintenance_mtx);
+    if (num_pending_prefaults == 0) {
+      pthread_mutex_unlock(&maintenance_mtx);
+      wait_for_maintenance();
+      continue;
+    }
+
+    size_t index = num_pending_prefaults - 1;
+    Region & region = pending_prefaults[index];
+    char * chunk = region.addr + region.populated_size;
+    size_t chunk_size = region.size - region.populated_size;
+    if (chunk_size > POPULATE_CHUNK_SIZE) {
+      chunk_size = POPULATE_CHUNK_SIZE;
+    }
+    pthread_mutex_unlock(&maintenance_mtx);
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    populate_region(chunk, chunk_size);
+    auto end_time = std::chrono::high_resolution_clock::now();
+
+    // only this thread removes regions, so the region is still at the same index
+    pthread_mutex_lock(&maintenance_mtx);
+    Region & populated = pending_prefaults[index];
+    populated.populated_size += chunk_size;
+    populated.duration_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+      end_time - start_time).count();
+    if (populated.populated_size == populated.size) {
+      Region done = populated;
+      pending_prefaults[index] = pending_prefaults[--num_pending_prefaults];
+      if (VERBOSE) {
+        pthread_mutex_unlock(&maintenance_mtx);
+        write_to_stderr(
+          "TLSF memory pool: ", done.size, " bytes populated in ", done.duration_ns,
+          " ns, RSS ", get_rss_bytes(), " bytes.\n");
+        pthread_mutex_lock(&maintenance_mtx);
+      }
+    }
+    pthread_mutex_unlock(&maintenance_mtx);
+  }
+  return nullptr;
+}
+
+// The maintenance thread does not survive fork. The heaps and the regions it works on are kept
+// consistent across fork, and the child starts a new thread at its first allocation.
+static void maintenance_fork_prepare()
+{
+  for (size_t i = 0; i < NUM_HEAPS; i++) {
+    pthread_mutex_lock(&heaps[i].mtx);
+  }
+  pthread_mutex_lock(&area_mtx);
+  pthread_mutex_lock(&maintenance_mtx);
+}
+
+static void maintenance_fork_parent()
+{
+  pthread_mutex_unlock(&maintenance_mtx);
+  pthread_mutex_unlock(&area_mtx);
+  for (size_t i = NUM_HEAPS; i > 0; i--) {
+    pthread_mutex_unlock(&heaps[i - 1].mtx);
+  }
+}
+
+static void maintenance_fork_child()
+{
+  // the locks are initialized again instead of unlocked, as only their owner can unlock
+  // priority-inheritance mutexes and the child runs on another thread id
+  pthread_mutexattr_t mutex_attr;
+  pthread_mutexattr_init(&mutex_attr);
+  if (REALTIME) {
+    pthread_mutexattr_setprotocol(&mutex_attr, PTHREAD_PRIO_INHERIT);
+  }
+  for (size_t i = 0; i < NUM_HEAPS; i++) {
+    pthread_mutex_init(&heaps[i].mtx, &mutex_attr);
+  }
+  pthread_mutexattr_destroy(&mutex_attr);
+  pthread_mutex_init(&area_mtx, nullptr);
+  pthread_mutex_init(&maintenance_mtx, nullptr);
+
+  // only the forking thread is left to allocate from the heaps
+  for (size_t i = 0; i < NUM_HEAPS; i++) {
+    heaps[i].num_threads.store(&heaps[i] == callsite_heap ? 1 : 0, std::memory_order_relaxed);
+  }
+  if (thread_heap != nullptr && !thread_heap_left) {
+    thread_heap->num_threads.store(1, std::memory_order_relaxed);
+  }
+
+  // the new thread picks up the requests of the lost one
+  maintenance_requested.store(1, std::memory_order_relaxed);
+  maintenance_thread_lost.store(true, std::memory_order_release);
+}
+
+static void start_maintenance_thread()
+{
+  static bool atfork_registered = false; // inherited by the child
+  if (!atfork_registered) {
+    pthread_atfork(maintenance_fork_prepare, maintenance_fork_parent, maintenance_fork_child);
+    atfork_registered = true;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, maintenance_main, NULL) != 0) {
+    write_to_stderr("TLSF memory pool: failed to start the maintenance thread.\n");
+    return;
+  }
+  pthread_detach(thread);
+}
+
+// called in the child of fork, outside of the locks of the heaps, as creating a thread allocates
+static void restart_maintenance_thread()
+{
+  bool lost = true;
+  if (maintenance_thread_lost.compare_exchange_strong(lost, false, std::memory_order_acquire)) {
+    start_maintenance_thread();
+  }
+}
+
+// applies PREFAULT_POLICY to a region newly added to the memory pool
+static void prefault_region(char * addr, size_t size)
+{
+  switch (PREFAULT_POLICY) {
+    case PrefaultPolicy::Lazy:
+      break;
+    case PrefaultPolicy::Sync:
+      populate_region(addr, size);
+      break;
+    case PrefaultPolicy::Populate:
+      pthread_mutex_lock(&maintenance_mtx);
+      if (num_pending_prefaults < MAX_PENDING_PREFAULTS) {
+        pending_prefaults[num_pending_prefaults++] = Region{addr, size, 0, 0};
+      }
+      pthread_mutex_unlock(&maintenance_mtx);
+      wake_maintenance_thread();
+      break;
+    case PrefaultPolicy::Lock:
+      if (mlock(addr, size) != 0) {
+        write_to_stderr("TLSF memory pool: mlock failed, the pool is not locked in memory.\n");
+      }
+      break;
+  }
+}
+
+// reads up to size - 1 bytes of path into buf without allocating, and returns the length.
+static size_t read_small_file(const char * path, char * buf, size_t size)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  size_t len = 0;
+  while (len + 1 < size) {
+    ssize_t n = read(fd, buf + len, size - 1 - len);
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+  }
+  close(fd);
+  buf[len] = '\0';
+  return len;
+}
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+static constexpr size_t HUGE_PAGE_SIZE_2M = 1ul << 21;
+static constexpr size_t HUGE_PAGE_SIZE_1G = 1ul << 30;
+
+static char * map_hugetlb(size_t & size, size_t huge_page_size)
+{
+  size_t mapped_size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+  int page_shift = __builtin_ctzl(huge_page_size);
+  void * addr = mmap(
+    NULL, mapped_size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_shift << MAP_HUGE_SHIFT), -1, 0);
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+  size = mapped_size;
+  return static_cast<char *>(addr);
+}
+
+// returns whether madvise(MADV_HUGEPAGE) can give transparent huge pages, i.e. their mode is
+// "always" or "madvise"
+static bool transparent_hugepages_enabled()
+{
+  char buf[128];
+  if (read_small_file("/sys/kernel/mm/transparent_hugepage/enabled", buf, sizeof(buf)) == 0) {
+    return false;
+  }
+  return strstr(buf, "[always]") != nullptr || strstr(buf, "[madvise]") != nullptr;
+}
+
+static char * map_transparent(size_t size, size_t & page_size)
+{
+  // map with slack and trim it, so that the area starts on a huge page boundary
+  size_t mapped_size = size + HUGE_PAGE_SIZE_2M;
+  void * raw = mmap(
+    NULL, mapped_size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    return nullptr;
+  }
+  char * begin = static_cast<char *>(raw);
+  char * addr = reinterpret_cast<char *>(
+    (reinterpret_cast<uintptr_t>(begin) + HUGE_PAGE_SIZE_2M - 1) & ~(HUGE_PAGE_SIZE_2M - 1));
+  if (addr > begin) {
+    munmap(begin, addr - begin);
+  }
+  if (begin + mapped_size > addr + size) {
+    munmap(addr + size, begin + mapped_size - (addr + size));
+  }
+
+  // madvise succeeds even when transparent huge pages are disabled system-wide, and they are
+  // only requested then: the kernel may still use base pages when it finds no free huge page.
+  if (transparent_hugepages_enabled() && madvise(addr, size, MADV_HUGEPAGE) == 0) {
+    page_size = HUGE_PAGE_SIZE_2M;
+  }
+  return addr;
+}
+
+// Maps an area for the memory pool according to HUGEPAGE_POLICY.
+// When the requested huge pages are not available, it falls back to smaller pages
+// (1G -> 2M -> transparent huge pages -> base pages) and reports it.
+// `size` is updated to the mapped size and `page_size` to the page size actually obtained.
+// Returns nullptr when even base pages cannot be mapped.
+static char * map_pool_area(size_t & size, size_t & page_size)
+{
+  page_size = sysconf(_SC_PAGESIZE);
+  size = (size + page_size - 1) & ~(page_size - 1);
+
+  char * addr = nullptr;
+  switch (HUGEPAGE_POLICY) {
+    case HugePagePolicy::Huge1G:
+      if ((addr = map_hugetlb(size, HUGE_PAGE_SIZE_1G)) != nullptr) {
+        page_size = HUGE_PAGE_SIZE_1G;
+        return addr;
+      }
+      write_to_stderr("TLSF memory pool: 1GB huge pages are not available, trying 2MB.\n");
+      [[fallthrough]];
+    case HugePagePolicy::Huge2M:
+      if ((addr = map_hugetlb(size, HUGE_PAGE_SIZE_2M)) != nullptr) {
+        page_size = HUGE_PAGE_SIZE_2M;
+        return addr;
+      }
+      write_to_stderr(
+        "TLSF memory pool: 2MB huge pages are not available, trying transparent huge pages.\n");
+      [[fallthrough]];
+    case HugePagePolicy::Transparent:
+      addr = map_transparent(size, page_size);
+      if (addr != nullptr && page_size != HUGE_PAGE_SIZE_2M) {
+        write_to_stderr(
+          "TLSF memory pool: transparent huge pages are not available, using ", page_size,
+          "-byte pages.\n");
+      }
+      return addr;
+    case HugePagePolicy::Off:
+    default:
+      addr = (char *) mmap(
+        NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      return addr == MAP_FAILED ? nullptr : addr;
+  }
+}
+
+// The profile of an executable is "<dir>/<executable name>-<hash of the command line>.tlsf",
+// so that the same executable launched with different arguments (e.g. component containers)
+// learns separately.
+static void init_profile_path(const char * dir)
+{
+  char exe[PATH_MAX];
+  ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (len <= 0) {
+    return;
+  }
+  exe[len] = '\0';
+  const char * name = strrchr(exe, '/');
+  name = name ? name + 1 : exe;
+
+  // FNV-1a
+  char cmdline[4096];
+  size_t cmdline_len = read_small_file("/proc/self/cmdline", cmdline, sizeof(cmdline));
+  size_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < cmdline_len; i++) {
+    hash = (hash ^ static_cast<unsigned char>(cmdline[i])) * 1099511628211ull;
+  }
+
+  if (strlen(dir) + strlen(name) + 32 >= sizeof(PROFILE_PATH)) {
+    write_to_stderr("TLSF memory pool: TLSF_PROFILE_DIR is too long, the profile is disabled.\n");
+    return;
+  }
+  format(PROFILE_PATH, dir, "/", name, "-", hash, ".tlsf");
+}
+
+// The profile is a text file of "key value" lines.
+//   runs N         the number of recorded runs
+//   pool_bytes N   the largest pool size needed by a run
+//   last_bytes N   the pool size needed by the last run
+//   last_areas N   the number of areas added in the last run
+struct PoolProfile
+{
+  size_t runs;
+  size_t pool_bytes;
+  size_t last_bytes;
+  size_t last_areas;
+};
+
+static size_t get_memory_bytes()
+{
+  return static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+}
+
+static bool load_pool_profile(PoolProfile & profile)
+{
+  char buf[1024];
+  if (read_small_file(PROFILE_PATH, buf, sizeof(buf)) == 0) {
+    return false;
+  }
+
+  profile = PoolProfile{};
+  char * line = buf;
+  while (*line != '\0') {
+    char * value = strchr(line, ' ');
+    char * next = strchr(line, '\n');
+    if (next == nullptr) {
+      next = line + strlen(line);
+    } else {
+      *next++ = '\0';
+    }
+    if (value != nullptr && value < next) {
+      *value++ = '\0';
+      size_t n = strtoull(value, nullptr, 10);
+      if (strcmp(line, "runs") == 0) {
+        profile.runs = n;
+      } else if (strcmp(line, "pool_bytes") == 0) {
+        profile.pool_bytes = n;
+      } else if (strcmp(line, "last_bytes") == 0) {
+        profile.last_bytes = n;
+      } else if (strcmp(line, "last_areas") == 0) {
+        profile.last_areas = n;
+      }
+    }
+    line = next;
+  }
+
+  // more than the memory of the machine was never needed: the profile is corrupt, and is learned
+  // again from this run
+  if (profile.pool_bytes > get_memory_bytes()) {
+    static bool reported = false;
+    if (!reported) {
+      write_to_stderr("TLSF memory pool: ignoring the corrupt profile ", PROFILE_PATH, ".\n");
+      reported = true;
+    }
+    return false;
+  }
+  return profile.pool_bytes > 0;
+}
+
+// records the pool size this run needed, merged with the previous runs.
+// runs from a destructor, after the destructors of the executable and the libraries loaded after
+// this one, so that the usage of the whole run is seen.
+__attribute__((destructor))
+static void save_pool_profile()
+{
+  if (!mempool_initialized || PROFILE_PATH[0] == '\0') {
+    return;
+  }
+
+  // the initial pool is split evenly, so every heap needs the slice of the busiest one
+  size_t peak_heap_bytes = 0;
+  size_t mapped_bytes = 0;
+  for (size_t i = 0; i < NUM_THREAD_HEAPS; i++) {
+    pthread_mutex_lock(&heaps[i].mtx);
+    if (heaps[i].peak_block_bytes > peak_heap_bytes) {
+      peak_heap_bytes = heaps[i].peak_block_bytes;
+    }
+    mapped_bytes += heaps[i].mapped_bytes;
+    pthread_mutex_unlock(&heaps[i].mtx);
+  }
+  size_t needed = peak_heap_bytes * NUM_THREAD_HEAPS;
+  size_t num_added_areas = num_areas.load(std::memory_order_acquire);
+  if (num_added_areas > 0 && mapped_bytes > needed) {
+    needed = mapped_bytes; // fragmentation made the pool grow beyond the peak usage
+  }
+
+  PoolProfile profile{};
+  if (!load_pool_profile(profile)) {
+    profile = PoolProfile{};
+  }
+  profile.runs++;
+  if (needed > profile.pool_bytes) {
+    profile.pool_bytes = needed;
+  }
+  profile.last_bytes = needed;
+  profile.last_areas = num_added_areas;
+
+  // written to a temporary file first, so that concurrent runs never see a partial profile
+  char tmp_path[PATH_MAX + 32];
+  format(tmp_path, PROFILE_PATH, ".", static_cast<size_t>(getpid()));
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    write_to_stderr("TLSF memory pool: failed to write the profile ", PROFILE_PATH, ".\n");
+    return;
+  }
+  char buf[256];
+  format(
+    buf, "runs ", profile.runs, "\npool_bytes ", profile.pool_bytes, "\nlast_bytes ",
+    profile.last_bytes, "\nlast_areas ", profile.last_areas, "\n");
+  bool written = write(fd, buf, strlen(buf)) == static_cast<ssize_t>(strlen(buf));
+  close(fd);
+  if (!written || rename(tmp_path, PROFILE_PATH) != 0) {
+    unlink(tmp_path);
+    write_to_stderr("TLSF memory pool: failed to write the profile ", PROFILE_PATH, ".\n");
+    return;
+  }
+
+  if (VERBOSE) {
+    write_to_stderr(
+      "TLSF memory pool: this run needed ", needed, " bytes (", num_added_areas,
+      " areas added), recorded in ", PROFILE_PATH, ".\n");
+  }
+}
+
+// lists the segregated call sites, in the format of TLSF_CALLSITE_FILE
+__attribute__((destructor))
+static void report_callsites()
+{
+  if (!VERBOSE || callsite_heap == nullptr) {
+    return;
+  }
+  write_to_stderr("TLSF memory pool: segregated call sites:\n");
+  CallsiteClassifier::getInstance().report();
+}
+
+static void init_heap(Heap * heap, char * pool, size_t size, const pthread_mutexattr_t * mutex_attr)
+{
+  pthread_mutex_init(&heap->mtx, mutex_attr);
+  heap->pool = pool;
+  init_memory_pool(size, heap->pool); // tlsf library function
+  heap->mapped_bytes = size;
+
+  // a fresh pool has a single free block, and the first allocation is carved from its head
+  heap->first_buffer = static_cast<char *>(malloc_ex(1, heap->pool));
+  free_ex(heap->first_buffer, heap->pool);
+  init_clean_ranges(heap);
+}
+
+// parses "<thread name or TID>=<bytes>,..." without allocating, as this runs inside the first malloc
+static void parse_thread_pools(const char * spec)
+{
+  while (*spec != '\0') {
+    const char * eq = strchr(spec, '=');
+    size_t len = eq ? eq - spec : 0;
+    if (num_thread_pools == MAX_THREAD_POOLS || len == 0 || len >= sizeof(ThreadPool::name)) {
+      write_to_stderr("TLSF memory pool: ignoring TLSF_THREAD_POOLS from ", spec, ".\n");
+      return;
+    }
+    ThreadPool & thread_pool = thread_pools[num_thread_pools++];
+    memcpy(thread_pool.name, spec, len);
+    thread_pool.name[len] = '\0';
+    if (strspn(thread_pool.name, "0123456789") == len) {
+      thread_pool.tid = static_cast<pid_t>(strtol(thread_pool.name, nullptr, 10));
+    }
+    char * end;
+    thread_pool.size = strtoull(eq + 1, &end, 10);
+    spec = *end == ',' ? end + 1 : end;
+  }
+}
+
+static void leave_thread_heap(void *);
+
+static void initialize_mempool()
+{
+  auto start_time = std::chrono::high_resolution_clock::now();
+
+  const char * initial_size_env = std::getenv("INITIAL_MEMPOOL_SIZE");
+  if (initial_size_env) {
+    INITIAL_MEMPOOL_SIZE = std::stoull(std::string(initial_size_env));
+  }
+
+  if (const char * env_p = std::getenv("ADDITIONAL_MEMPOOL_SIZE")) {
+    ADDITIONAL_MEMPOOL_SIZE = std::stoull(std::string(env_p));
+  }
+
+  if (const char * env_p = std::getenv("TLSF_THREAD_HEAPS")) {
+    NUM_THREAD_HEAPS = std::stoull(std::string(env_p));
+    if (NUM_THREAD_HEAPS == 0) {
+      NUM_THREAD_HEAPS = 1;
+    } else if (NUM_THREAD_HEAPS > MAX_THREAD_HEAPS) {
+      NUM_THREAD_HEAPS = MAX_THREAD_HEAPS;
+    }
+  }
+
+  if (const char * env_p = std::getenv("TLSF_CALLSITE_POOL_SIZE")) {
+    CALLSITE_POOL_SIZE = std::stoull(std::string(env_p));
+  }
+
+  CALLSITE_FILE = std::getenv("TLSF_CALLSITE_FILE");
+
+  if (const char * env_p = std::getenv("TLSF_THREAD_POOLS")) {
+    parse_thread_pools(env_p);
+  }
+
+  if (const char * env_p = std::getenv("TLSF_MMAP_THRESHOLD")) {
+    MMAP_THRESHOLD = std::stoull(std::string(env_p));
+  }
+
+  if (const char * env_p = std::getenv("TLSF_MMAP_CACHE_SIZE")) {
+    MMAP_CACHE_SIZE = std::stoull(std::string(env_p));
+  }
+
+  if (const char * env_p = std::getenv("TLSF_PREFAULT")) {
+    if (strcmp(env_p, "lazy") == 0) {
+      PREFAULT_POLICY = PrefaultPolicy::Lazy;
+    } else if (strcmp(env_p, "sync") == 0) {
+      PREFAULT_POLICY = PrefaultPolicy::Sync;
+    } else if (strcmp(env_p, "populate") == 0) {
+      PREFAULT_POLICY = PrefaultPolicy::Populate;
+    } else if (strcmp(env_p, "mlock") == 0) {
+      PREFAULT_POLICY = PrefaultPolicy::Lock;
+    } else {
+      write_to_stderr("TLSF memory pool: unknown TLSF_PREFAULT, using sync.\n");
+    }
+  }
+
+  if (const char * env_p = std::getenv("TLSF_HUGEPAGE")) {
+    if (strcmp(env_p, "off") == 0) {
+      HUGEPAGE_POLICY = HugePagePolicy::Off;
+    } else if (strcmp(env_p, "thp") == 0) {
+      HUGEPAGE_POLICY = HugePagePolicy::Transparent;
+    } else if (strcmp(env_p, "2M") == 0) {
+      HUGEPAGE_POLICY = HugePagePolicy::Huge2M;
+    } else if (strcmp(env_p, "1G") == 0) {
+      HUGEPAGE_POLICY = HugePagePolicy::Huge1G;
+    } else {
+      write_to_stderr("TLSF memory pool: unknown TLSF_HUGEPAGE, using off.\n");
+    }
+  }
+
+  if (const char * env_p = std::getenv("TLSF_RELEASE_THRESHOLD")) {
+    RELEASE_THRESHOLD = std::stoull(std::string(env_p));
+  }
+
+  if (const char * env_p = std::getenv("TLSF_LOW_WATERMARK")) {
+    LOW_WATERMARK = std::stoull(std::string(env_p));
+  }
+
+  if (const char * env_p = std::getenv("TLSF_SLAB_ARENA_SIZE")) {
+    SLAB_ARENA_SIZE = std::stoull(std::string(env_p));
+  }
+
+  if (const char * env_p = std::getenv("TLSF_RELEASE_ADVICE")) {
+    if (strcmp(env_p, "dontneed") == 0) {
+      RELEASE_ADVICE = MADV_DONTNEED;
+    } else if (strcmp(env_p, "free") == 0) {
+      RELEASE_ADVICE = MADV_FREE;
+    } else {
+      write_to_stderr("TLSF memory pool: unknown TLSF_RELEASE_ADVICE, using dontneed.\n");
+    }
+  }
+
+  if (const char * env_p = std::getenv("TLSF_REMOTE_FREE")) {
+    if (strcmp(env_p, "on") == 0) {
+      REMOTE_FREE = true;
+    } else if (strcmp(env_p, "off") == 0) {
+      REMOTE_FREE = false;
+    } else {
+      write_to_stderr("TLSF memory pool: unknown TLSF_REMOTE_FREE, using on.\n");
+    }
+  }
+
+  if (const char * env_p = std::getenv("TLSF_VERBOSE")) {
+    VERBOSE = env_p[0] == '1';
+  }
+
+  if (const char * env_p = std::getenv("HEAPHOOK_RT")) {
+    REALTIME = env_p[0] == '1';
+  }
+
+  if (REALTIME) {
+    PREFAULT_POLICY = PrefaultPolicy::Lock;
+    EXHAUSTION_POLICY = ExhaustionPolicy::Fail;
+    REMOTE_FREE = false;
+    if (MMAP_THRESHOLD > 0) {
+      write_to_stderr("TLSF memory pool: TLSF_MMAP_THRESHOLD is ignored with HEAPHOOK_RT=1.\n");
+      MMAP_THRESHOLD = 0;
+    }
+    if (LOW_WATERMARK > 0) {
+      write_to_stderr("TLSF memory pool: TLSF_LOW_WATERMARK is ignored with HEAPHOOK_RT=1.\n");
+      LOW_WATERMARK = 0;
+    }
+  }
+
+  if (const char * env_p = std::getenv("TLSF_ON_EXHAUSTION")) {
+    if (strcmp(env_p, "grow") == 0 && !REALTIME) {
+      EXHAUSTION_POLICY = ExhaustionPolicy::Grow;
+    } else if (strcmp(env_p, "enomem") == 0) {
+      EXHAUSTION_POLICY = ExhaustionPolicy::Fail;
+    } else if (strcmp(env_p, "abort") == 0) {
+      EXHAUSTION_POLICY = ExhaustionPolicy::Abort;
+    } else if (REALTIME) {
+      write_to_stderr(
+        "TLSF memory pool: TLSF_ON_EXHAUSTION must be enomem or abort with HEAPHOOK_RT=1, "
+        "using enomem.\n");
+    } else {
+      write_to_stderr("TLSF memory pool: unknown TLSF_ON_EXHAUSTION, using grow.\n");
+    }
+  }
+
+  pthread_mutexattr_t mutex_attr;
+  pthread_mutexattr_init(&mutex_attr);
+  if (REALTIME) {
+    pthread_mutexattr_setprotocol(&mutex_attr, PTHREAD_PRIO_INHERIT);
+  }
+
+  if (const char * env_p = std::getenv("TLSF_PROFILE_MARGIN")) {
+    PROFILE_MARGIN_PERCENT = std::stoull(std::string(env_p));
+  }
+
+  if (const char * env_p = std::getenv("TLSF_PROFILE_DIR")) {
+    init_profile_path(env_p);
+  }
+
+  PoolProfile profile;
+  if (PROFILE_PATH[0] != '\0' && !initial_size_env && load_pool_profile(profile)) {
+    // clamped between a minimum slice per heap and the memory of the machine
+    size_t size;
+    if (__builtin_mul_overflow(profile.pool_bytes / 100, PROFILE_MARGIN_PERCENT, &size) ||
+      __builtin_add_overflow(size, profile.pool_bytes, &size) || size > get_memory_bytes())
+    {
+      size = get_memory_bytes();
+    }
+    if (size < NUM_THREAD_HEAPS * MIN_PROFILED_HEAP_SIZE) {
+      size = NUM_THREAD_HEAPS * MIN_PROFILED_HEAP_SIZE;
+    }
+    INITIAL_MEMPOOL_SIZE = size;
+    if (VERBOSE) {
+      write_to_stderr(
+        "TLSF memory pool: ", INITIAL_MEMPOOL_SIZE, " bytes from the profile of ", profile.runs,
+        " runs in ", PROFILE_PATH, ".\n");
+    }
+  }
+
+  init_pool_events();
+  pthread_key_create(&thread_heap_key, leave_thread_heap);
+
+  size_t & pool_page_size = mempool_page_size;
+  mempool_ptr = map_pool_area(INITIAL_MEMPOOL_SIZE, pool_page_size);
+  if (mempool_ptr == nullptr) {
+    write_to_stderr("TLSF memory pool: failed to map ", INITIAL_MEMPOOL_SIZE, " bytes.\n");
+    abort();
+  }
+  prefault_region(mempool_ptr, INITIAL_MEMPOOL_SIZE);
+
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  heap_slice_size = (INITIAL_MEMPOOL_SIZE / NUM_THREAD_HEAPS) & ~(page_size - 1);
+  for (size_t i = 0; i < NUM_THREAD_HEAPS; i++) {
+    size_t size = (i + 1 < NUM_THREAD_HEAPS) ?
+      heap_slice_size : INITIAL_MEMPOOL_SIZE - i * heap_slice_size;
+    init_heap(&heaps[i], mempool_ptr + i * heap_slice_size, size, &mutex_attr);
+  }
+  NUM_HEAPS = NUM_THREAD_HEAPS;
+
+  if (CALLSITE_POOL_SIZE > 0) {
+    size_t callsite_page_size;
+    callsite_pool = map_pool_area(CALLSITE_POOL_SIZE, callsite_page_size);
+    if (callsite_pool == nullptr) {
+      write_to_stderr(
+        "TLSF memory pool: failed to map ", CALLSITE_POOL_SIZE, " bytes for call sites.\n");
+    } else if (!CallsiteClassifier::getInstance().init(CALLSITE_FILE)) {
+      write_to_stderr("TLSF memory pool: failed to read TLSF_CALLSITE_FILE.\n");
+      munmap(callsite_pool, CALLSITE_POOL_SIZE);
+      callsite_pool = nullptr;
+    } else {
+      prefault_region(callsite_pool, CALLSITE_POOL_SIZE);
+      callsite_heap = &heaps[NUM_HEAPS++];
+      callsite_heap->num_threads.store(1); // shared by all threads, so never left
+      init_heap(callsite_heap, callsite_pool, CALLSITE_POOL_SIZE, &mutex_attr);
+    }
+  }
+
+  for (size_t i = 0; i < num_thread_pools; i++) {
+    ThreadPool & thread_pool = thread_pools[i];
+    size_t thread_pool_page_size;
+    thread_pool.pool = map_pool_area(thread_pool.size, thread_pool_page_size);
+    if (thread_pool.pool == nullptr) {
+      write_to_stderr(
+        "TLSF memory pool: failed to map ", thread_pool.size, " bytes for thread ",
+        thread_pool.name, ".\n");
+      thread_pool.size = 0;
+      continue;
+    }
+    prefault_region(thread_pool.pool, thread_pool.size);
+    thread_pool.heap = &heaps[NUM_HEAPS++];
+    init_heap(thread_pool.heap, thread_pool.pool, thread_pool.size, &mutex_attr);
+  }
+
+  if (SLAB_ARENA_SIZE > 0) {
+    char * arena = static_cast<char *>(malloc_ex(SLAB_ARENA_SIZE, heaps[0].pool));
+    if (arena == nullptr) {
+      write_to_stderr("TLSF memory pool: no room for the slab arena, small objects use TLSF.\n");
+    } else {
+      take_clean_ranges(&heaps[0], arena, nullptr);
+      heaps[0].used_bytes += SLAB_ARENA_SIZE;
+      heaps[0].num_used_blocks++;
+      SlabAllocator::getInstance().init(arena, SLAB_ARENA_SIZE, &mutex_attr);
+    }
+  }
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  // the stacks, the libraries and everything mapped later are locked as well
+  if (REALTIME && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    write_to_stderr("TLSF memory pool: mlockall failed, the process is not locked in memory.\n");
+  }
+
+  if (VERBOSE) {
+    auto end_time = std::chrono::high_resolution_clock::now();
+    size_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      end_time - start_time).count();
+    static const char * policy_names[] = {"lazy", "sync", "populate", "mlock"};
+    write_to_stderr(
+      "TLSF memory pool: ", INITIAL_MEMPOOL_SIZE, " bytes of ", pool_page_size,
+      "-byte pages (prefault=", policy_names[static_cast<int>(PREFAULT_POLICY)],
+      ") initialized in ", duration, " ns, RSS ", get_rss_bytes(), " bytes.\n");
+  }
+}
+
+// returns the heap of TLSF_THREAD_POOLS the calling thread is listed in, or nullptr
+static Heap * find_thread_pool_heap()
+{
+  char name[16] = {};
+  prctl(PR_GET_NAME, name); // unlike pthread_getname_np, never opens a file
+  pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+  for (size_t i = 0; i < num_thread_pools; i++) {
+    const ThreadPool & thread_pool = thread_pools[i];
+    bool listed = thread_pool.tid != 0 ?
+      thread_pool.tid == tid : strcmp(thread_pool.name, name) == 0;
+    if (listed && thread_pool.heap != nullptr) {
+      if (VERBOSE) {
+        write_to_stderr(
+          "TLSF memory pool: thread ", name, " (", static_cast<size_t>(tid),
+          ") uses the pool of ", thread_pool.name, ".\n");
+      }
+      return thread_pool.heap;
+    }
+  }
+  return nullptr;
+}
+
+static void drain_remote_frees(Heap * heap);
+static void check_release_threshold(Heap * heap);
+
+// Each heap counts the threads allocating from it. Blocks freed to a heap by other threads are
+// freed by these threads on their next allocation, by the last of them when it leaves the heap,
+// and by the freeing thread itself when the heap has none (see free_in_heap).
+static void leave_heap(Heap * heap)
+{
+  // the loads see every block pushed before the count dropped, as in free_in_heap
+  if (heap->num_threads.fetch_sub(1) == 1 && heap->remote_frees.load() != nullptr) {
+    pthread_mutex_lock(&heap->mtx);
+    drain_remote_frees(heap);
+    check_release_threshold(heap);
+    pthread_mutex_unlock(&heap->mtx);
+  }
+}
+
+static void set_thread_heap(Heap * heap)
+{
+  Heap * old_heap = thread_heap;
+  thread_heap = heap;
+  if (thread_heap_left) {
+    return;
+  }
+  if (heap != nullptr) {
+    heap->num_threads.fetch_add(1);
+  }
+  if (old_heap != nullptr) {
+    leave_heap(old_heap);
+  } else {
+    // after thread_heap is set, as it may allocate
+    pthread_setspecific(thread_heap_key, heaps);
+  }
+}
+
+// the destructor of thread_heap_key. the heap is kept for the allocations made after it.
+static void leave_thread_heap(void *)
+{
+  thread_heap_left = true;
+  if (thread_heap != nullptr) {
+    leave_heap(thread_heap);
+  }
+}
+
+// takes the entry of the calling thread from renamed_threads, if another thread renamed it
+static void take_rename()
+{
+  pthread_t self = pthread_self();
+  for (auto & renamed : renamed_threads) {
+    pthread_t expected = self;
+    if (renamed.load(std::memory_order_relaxed) == self &&
+      renamed.compare_exchange_strong(expected, 0, std::memory_order_acquire))
+    {
+      num_renamed_threads.fetch_sub(1, std::memory_order_relaxed);
+      thread_heap_looked_up = false;
+    }
+  }
+}
+
+static Heap * get_thread_heap()
+{
+  if (num_thread_pools > 0) {
+    if (num_renamed_threads.load(std::memory_order_acquire) > 0) {
+      take_rename();
+    }
+    if (!thread_heap_looked_up) {
+      thread_heap_looked_up = true;
+      Heap * heap = find_thread_pool_heap();
+      if (heap != nullptr || thread_heap_dedicated) {
+        // a thread renamed out of its pool goes back to the thread heaps
+        set_thread_heap(heap);
+        thread_heap_dedicated = heap != nullptr;
+      }
+    }
+  }
+  if (thread_heap == nullptr) {
+    size_t idx = num_assigned_threads.fetch_add(1, std::memory_order_relaxed);
+    set_thread_heap(&heaps[idx % NUM_THREAD_HEAPS]);
+  }
+  return thread_heap;
+}
+
+// records a thread renamed by another thread in renamed_threads
+static void add_rename(pthread_t thread)
+{
+  // counted first, so that the count never drops below the used entries
+  num_renamed_threads.fetch_add(1, std::memory_order_relaxed);
+  for (auto & renamed : renamed_threads) {
+    pthread_t expected = 0;
+    if (renamed.compare_exchange_strong(expected, thread, std::memory_order_release)) {
+      return;
+    }
+    if (expected == thread) {
+      num_renamed_threads.fetch_sub(1, std::memory_order_relaxed);
+      return; // renamed again before it looked its heap up
+    }
+  }
+  num_renamed_threads.fetch_sub(1, std::memory_order_relaxed);
+  static std::atomic<bool> reported{false};
+  if (!reported.exchange(true, std::memory_order_relaxed)) {
+    write_to_stderr(
+      "TLSF memory pool: more than ", MAX_RENAMED_THREADS,
+      " threads renamed by others at once, a renamed thread may keep its heap.\n");
+  }
+}
+
+// a renamed thread looks its heap up again on its next allocation.
+// only the renamed thread does, so that the others make no system call.
+extern "C" int pthread_setname_np(pthread_t thread, const char * name)
+{
+  static pthread_setname_np_type original_pthread_setname_np =
+    reinterpret_cast<pthread_setname_np_type>(dlsym(RTLD_NEXT, "pthread_setname_np"));
+  int ret = original_pthread_setname_np(thread, name);
+  if (ret != 0 || (mempool_initialized && num_thread_pools == 0)) {
+    return ret;
+  }
+  if (pthread_equal(thread, pthread_self())) {
+    thread_heap_looked_up = false;
+  } else {
+    add_rename(thread);
+  }
+  return ret;
+}
+
+// returns the heap which ptr was allocated from,
+// or nullptr if ptr was not allocated from the memory pool.
+static Heap * find_heap(void * ptr)
+{
+  char * addr = static_cast<char *>(ptr);
+  if (addr >= mempool_ptr && addr < mempool_ptr + INITIAL_MEMPOOL_SIZE) {
+    size_t idx = (addr - mempool_ptr) / heap_slice_size;
+    return &heaps[idx < NUM_THREAD_HEAPS ? idx : NUM_THREAD_HEAPS - 1];
+  }
+
+  if (addr >= callsite_pool && addr < callsite_pool + CALLSITE_POOL_SIZE) {
+    return callsite_heap;
+  }
+
+  for (size_t i = 0; i < num_thread_pools; i++) {
+    if (addr >= thread_pools[i].pool && addr < thread_pools[i].pool + thread_pools[i].size) {
+      return thread_pools[i].heap;
+    }
+  }
+
+  size_t n = num_areas.load(std::memory_order_acquire);
+  for (size_t i = 0; i < n; i++) {
+    if (addr >= areas[i].begin && addr < areas[i].end) {
+      return areas[i].heap;
+    }
+  }
+  return nullptr;
+}
+
+static void register_area(char * addr, size_t size, Heap * heap, size_t page_size)
+{
+  pthread_mutex_lock(&area_mtx);
+  size_t n = num_areas.load(std::memory_order_relaxed);
+  if (n == MAX_AREAS) {
+    write_to_stderr("TLSF memory pool: too many additional areas.\n");
+    abort();
+  }
+  areas[n] = Area{addr, addr + size, heap, page_size};
+  num_areas.store(n + 1, std::memory_order_release);
+  pthread_mutex_unlock(&area_mtx);
+}
+
+// Do not use printf
+void check_mempool_initialized()
+{
+  if (mempool_initialized) {return;}
+
+  pthread_mutex_lock(&init_mtx);
+
+  if (!mempool_init_started) {
+    mempool_init_started = true;
+    pthread_mutex_unlock(&init_mtx);
+
+    initialize_mempool();
+
+    mempool_initialized = true;
+    pthread_cond_signal(&init_cond);
+
+    start_maintenance_thread();
+  } else {
+    while (!mempool_initialized) {
+      pthread_cond_wait(&init_cond, &init_mtx);
+    }
+
+    pthread_mutex_unlock(&init_mtx);
+  }
+}
+
+//               |--------------------|
+//               |      prev_hdr      |
+//               |--------------------|
+//               |        size    |P|F|
+//               |--------------------|
+//  block_ptr -> |       buffer       |
+//               |--------------------|
+//
+// The tlsf library returns buffers aligned to TLSF_ALIGNMENT, and the word preceding
+// a buffer holds its size, whose FREE bit (F) is always 0 while the block is used.
+//
+// When a stricter alignment is requested, the next aligned pointer after block_ptr is returned
+// instead, preceded by a tag whose F bit is 1.
+//
+//               |--------------------|
+//               |        size    |P|0|
+//               |--------------------| -+
+//  block_ptr -> |                    |  |
+//               |--------------------|  |
+//               |     alignment      |  | offset
+//               |--------------------|  |
+//               |       offset   |0|1|  |
+//               |--------------------| -+
+//    aligned -> |       buffer       |
+//               |--------------------|
+//
+// So free and usable size of aligned blocks are O(1), without any lookup table.
+static constexpr size_t TLSF_ALIGNMENT = 2 * sizeof(void *);
+static constexpr size_t BLOCK_SIZE_MASK = ~0b1111ull;
+static constexpr size_t ALIGNED_TAG = 0b1;
+
+static inline size_t header_word(void * ptr)
+{
+  return reinterpret_cast<size_t *>(ptr)[-1];
+}
+
+static inline bool is_aligned_tag(size_t word)
+{
+  return word & ALIGNED_TAG;
+}
+
+// returns the pointer which the tlsf library returned for the block ptr belongs to
+static inline void * block_ptr_of(void * ptr)
+{
+  size_t word = header_word(ptr);
+  if (is_aligned_tag(word)) {
+    return static_cast<char *>(ptr) - (word & BLOCK_SIZE_MASK);
+  }
+  return ptr;
+}
+
+static inline size_t usable_size_of(void * ptr)
+{
+  size_t word = header_word(ptr);
+  if (is_aligned_tag(word)) {
+    size_t offset = word & BLOCK_SIZE_MASK;
+    void * block_ptr = static_cast<char *>(ptr) - offset;
+    return (header_word(block_ptr) & BLOCK_SIZE_MASK) - offset;
+  }
+  return word & BLOCK_SIZE_MASK;
+}
+
+static constexpr size_t BLOCK_OVERHEAD = 2 * sizeof(void *); // prev_hdr and size
+static constexpr size_t FREE_BLOCK = 0b1;
+static constexpr size_t FREE_LIST_LINKS_SIZE = 2 * sizeof(void *); // head of a free buffer
+
+static inline size_t block_size_of(void * block_ptr)
+{
+  return header_word(block_ptr) & BLOCK_SIZE_MASK;
+}
+
+// Blocks of MMAP_THRESHOLD bytes or more are laid out as follows
+//
+//   mapping -> |--------------------| page boundary
+//              |    mapped size     |
+//              |--------------------|
+//              | mapping ^ MAGIC    |
+//       ptr -> |--------------------|
+//              |       buffer       |
+//              |--------------------| page boundary
+//
+// They are not in any heap, so they are recognized by the cookie when find_heap fails.
+// The header is on the same page as ptr, so it can be read even if ptr came from glibc.
+struct LargeBlock
+{
+  size_t mapped_size;
+  uintptr_t cookie;
+};
+
+static constexpr uintptr_t LARGE_BLOCK_MAGIC = 0x6c61726765626c6bull;
+static_assert(sizeof(LargeBlock) == BLOCK_OVERHEAD, "stats count large blocks as TLSF blocks");
+
+static inline uintptr_t large_cookie_of(LargeBlock * block)
+{
+  return reinterpret_cast<uintptr_t>(block) ^ LARGE_BLOCK_MAGIC;
+}
+
+// returns the header of ptr, or nullptr if ptr is not a large block
+static LargeBlock * large_block_of(void * ptr)
+{
+  if (reinterpret_cast<uintptr_t>(ptr) % getpagesize() != sizeof(LargeBlock)) {
+    return nullptr;
+  }
+  LargeBlock * block = static_cast<LargeBlock *>(ptr) - 1;
+  return block->cookie == large_cookie_of(block) ? block : nullptr;
+}
+
+// returns 0 on overflow
+static size_t large_mapped_size(size_t size)
+{
+  size_t page_size = getpagesize();
+  size_t bytes;
+  if (__builtin_add_overflow(size, sizeof(LargeBlock) + page_size - 1, &bytes)) {
+    return 0;
+  }
+  return bytes & ~(page_size - 1);
+}
+
+// the whole mapping but the header is usable, so malloc_usable_size stays exact
+static inline size_t large_usable_size(LargeBlock * block)
+{
+  return block->mapped_size - sizeof(LargeBlock);
+}
+
+// Freed large blocks kept mapped, in LIFO lists by the power of 2 below their mapped size.
+// A cached block has its cookie cleared and is linked through its buffer.
+static constexpr size_t NUM_MAPPING_BUCKETS = 64;
+static pthread_mutex_t mapping_cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+static LargeBlock * cached_mappings[NUM_MAPPING_BUCKETS];
+static std::atomic<size_t> cached_mapping_bytes{0};
+
+static inline LargeBlock *& next_cached_mapping(LargeBlock * block)
+{
+  return *reinterpret_cast<LargeBlock **>(block + 1);
+}
+
+static inline size_t mapping_bucket_of(size_t mapped_size)
+{
+  return 63 - __builtin_clzl(mapped_size);
+}
+
+// returns a cached block of mapped_size to 5/4 * mapped_size bytes, or nullptr
+static LargeBlock * take_cached_mapping(size_t mapped_size)
+{
+  if (cached_mapping_bytes.load(std::memory_order_relaxed) == 0) {
+    return nullptr;
+  }
+  size_t max_size = mapped_size + mapped_size / 4;
+
+  LargeBlock * found = nullptr;
+  pthread_mutex_lock(&mapping_cache_mtx);
+  for (size_t b = mapping_bucket_of(mapped_size); b <= mapping_bucket_of(max_size); b++) {
+    LargeBlock ** link = &cached_mappings[b];
+    while (*link != nullptr &&
+      ((*link)->mapped_size < mapped_size || (*link)->mapped_size > max_size))
+    {
+      link = &next_cached_mapping(*link);
+    }
+    if (*link != nullptr) {
+      found = *link;
+      *link = next_cached_mapping(found);
+      cached_mapping_bytes.fetch_sub(found->mapped_size, std::memory_order_relaxed);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mapping_cache_mtx);
+  return found;
+}
+
+// keeps block mapped, unmapping the largest cached blocks to stay within MMAP_CACHE_SIZE.
+// returns false if block alone exceeds it.
+static bool cache_mapping(LargeBlock * block)
+{
+  if (block->mapped_size > MMAP_CACHE_SIZE) {
+    return false;
+  }
+
+  LargeBlock * evicted = nullptr;
+  pthread_mutex_lock(&mapping_cache_mtx);
+  size_t cached = cached_mapping_bytes.load(std::memory_order_relaxed);
+  size_t b = NUM_MAPPING_BUCKETS - 1;
+  while (cached + block->mapped_size > MMAP_CACHE_SIZE) {
+    while (cached_mappings[b] == nullptr) {
+      b--;
+    }
+    LargeBlock * victim = cached_mappings[b];
+    cached_mappings[b] = next_cached_mapping(victim);
+    cached -= victim->mapped_size;
+    next_cached_mapping(victim) = evicted;
+    evicted = victim;
+  }
+  size_t bucket = mapping_bucket_of(block->mapped_size);
+  next_cached_mapping(block) = cached_mappings[bucket];
+  cached_mappings[bucket] = block;
+  cached_mapping_bytes.store(cached + block->mapped_size, std::memory_order_relaxed);
+  pthread_mutex_unlock(&mapping_cache_mtx);
+
+  // unmapped outside the lock
+  while (evicted != nullptr) {
+    LargeBlock * next = next_cached_mapping(evicted);
+    munmap(evicted, evicted->mapped_size);
+    evicted = next;
+  }
+  return true;
+}
+
+// unmaps every cached block, and returns the number of bytes unmapped
+static size_t release_cached_mappings()
+{
+  LargeBlock * released[NUM_MAPPING_BUCKETS];
+  pthread_mutex_lock(&mapping_cache_mtx);
+  for (size_t b = 0; b < NUM_MAPPING_BUCKETS; b++) {
+    released[b] = cached_mappings[b];
+    cached_mappings[b] = nullptr;
+  }
+  size_t released_bytes = cached_mapping_bytes.exchange(0, std::memory_order_relaxed);
+  pthread_mutex_unlock(&mapping_cache_mtx);
+
+  for (size_t b = 0; b < NUM_MAPPING_BUCKETS; b++) {
+    while (released[b] != nullptr) {
+      LargeBlock * next = next_cached_mapping(released[b]);
+      munmap(released[b], released[b]->mapped_size);
+      released[b] = next;
+    }
+  }
+  return released_bytes;
+}
+
+// a fresh mapping is zero-filled, and a cached one is cleared if clear is set
+static void * large_malloc(size_t size, bool clear = false)
+{
+  size_t mapped_size = large_mapped_size(size);
+  if (mapped_size == 0) {
+    return nullptr;
+  }
+  LargeBlock * block = MMAP_CACHE_SIZE > 0 ? take_cached_mapping(mapped_size) : nullptr;
+  if (block != nullptr) {
+    mapped_size = block->mapped_size;
+    if (clear) {
+      memset(block + 1, 0, size);
+    }
+  } else {
+    void * addr = mmap(
+      NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      return nullptr;
+    }
+    block = static_cast<LargeBlock *>(addr);
+    block->mapped_size = mapped_size;
+  }
+  block->cookie = large_cookie_of(block);
+  large_mapped_bytes.fetch_add(mapped_size, std::memory_order_relaxed);
+  num_large_blocks.fetch_add(1, std::memory_order_relaxed);
+  return block + 1;
+}
+
+static void large_free(LargeBlock * block)
+{
+  large_mapped_bytes.fetch_sub(block->mapped_size, std::memory_order_relaxed);
+  num_large_blocks.fetch_sub(1, std::memory_order_relaxed);
+  block->cookie = 0;
+  if (MMAP_CACHE_SIZE > 0 && cache_mapping(block)) {
+    return;
+  }
+  munmap(block, block->mapped_size);
+}
 
-#include "heaphook/heaphook.hpp"
-#include "heaphook/hook_types.hpp"
-#include "heaphook/utils.hpp"
+// returns nullptr and keeps the block if the mapping cannot be resized
+static void * large_realloc(LargeBlock * block, size_t new_size)
+{
+  size_t old_mapped_size = block->mapped_size;
+  size_t mapped_size = large_mapped_size(new_size);
+  if (mapped_size == 0) {
+    return nullptr;
+  }
+  if (mapped_size == old_mapped_size) {
+    return block + 1;
+  }
+  void * addr = mremap(block, old_mapped_size, mapped_size, MREMAP_MAYMOVE);
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+  block = static_cast<LargeBlock *>(addr);
+  block->mapped_size = mapped_size;
+  block->cookie = large_cookie_of(block);
+  large_mapped_bytes.fetch_add(mapped_size - old_mapped_size, std::memory_order_relaxed);
+  return block + 1;
+}
 
-static char * mempool_ptr;
-static size_t INITIAL_MEMPOOL_SIZE = 100 * 1000 * 1000; // default: 100MB
-static size_t ADDITIONAL_MEMPOOL_SIZE = 100 * 1000 * 1000; // default: 100MB
-static std::unordered_map<void *, void *> * aligned2orig;
+// the caller holds the lock of the heap.
+static void add_clean_range(Heap * heap, char * begin, char * end)
+{
+  CleanRanges & clean = heap->clean;
+  for (size_t i = 0; i < clean.count; i++) {
+    CleanRange & range = clean.ranges[i];
+    if (begin <= range.end && range.begin <= end) {
+      // the union of two overlapping clean ranges is clean
+      range.begin = begin < range.begin ? begin : range.begin;
+      range.end = end > range.end ? end : range.end;
+      return;
+    }
+  }
+  if (clean.count < MAX_CLEAN_RANGES) {
+    clean.ranges[clean.count++] = CleanRange{begin, end};
+  }
+}
 
-static pthread_mutex_t init_mtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t init_cond = PTHREAD_COND_INITIALIZER; // mempool_initialized == true
-static bool mempool_initialized = false;
-static bool mempool_init_started = false; // guarded by init_mtx
+// Removes the range a block handed out may write to from the clean ranges of the heap, and
+// appends the removed parts to taken if it is not null. The tlsf library writes the header and
+// the free list links of the remainder right after the block, which are included.
+// the caller holds the lock of the heap.
+static void take_clean_ranges(Heap * heap, void * block_ptr, CleanRanges * taken)
+{
+  char * begin = static_cast<char *>(block_ptr) - BLOCK_OVERHEAD;
+  char * end = static_cast<char *>(block_ptr) + block_size_of(block_ptr) + BLOCK_OVERHEAD +
+    FREE_LIST_LINKS_SIZE;
+  CleanRanges & clean = heap->clean;
+  size_t i = 0;
+  while (i < clean.count) {
+    CleanRange & range = clean.ranges[i];
+    if (end <= range.begin || range.end <= begin) {
+      i++;
+      continue;
+    }
+    if (taken != nullptr) {
+      taken->ranges[taken->count++] = CleanRange{
+        range.begin > begin ? range.begin : begin, range.end < end ? range.end : end};
+    }
+    if (begin <= range.begin && range.end <= end) {
+      clean.ranges[i] = clean.ranges[--clean.count];
+      continue;
+    }
+    if (range.begin < begin && end < range.end) {
+      // the part after the block is forgotten when there is no room for it
+      if (clean.count < MAX_CLEAN_RANGES) {
+        clean.ranges[clean.count++] = CleanRange{end, range.end};
+      }
+      clean.ranges[i].end = begin;
+    } else if (range.begin < begin) {
+      range.end = begin;
+    } else {
+      range.begin = end;
+    }
+    i++;
+  }
+}
 
-static pthread_mutex_t tlsf_mtx = PTHREAD_MUTEX_INITIALIZER;
+#if defined(__SSE2__)
+// larger clears bypass the cache, so that they do not evict the working set
+static constexpr size_t NON_TEMPORAL_CLEAR_SIZE = 1024 * 1024;
 
-static void initialize_mempool()
+static void clear(char * begin, char * end)
 {
-  if (const char * env_p = std::getenv("INITIAL_MEMPOOL_SIZE")) {
-    INITIAL_MEMPOOL_SIZE = std::stoull(std::string(env_p));
+  if (static_cast<size_t>(end - begin) < NON_TEMPORAL_CLEAR_SIZE) {
+    memset(begin, 0, end - begin);
+    return;
   }
+  char * aligned_begin = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(begin) + 15) & ~15ull);
+  char * aligned_end = reinterpret_cast<char *>(reinterpret_cast<uintptr_t>(end) & ~15ull);
+  memset(begin, 0, aligned_begin - begin);
+  __m128i zero = _mm_setzero_si128();
+  for (char * p = aligned_begin; p < aligned_end; p += 16) {
+    _mm_stream_si128(reinterpret_cast<__m128i *>(p), zero);
+  }
+  _mm_sfence();
+  memset(aligned_end, 0, end - aligned_end);
+}
+#else
+static void clear(char * begin, char * end)
+{
+  memset(begin, 0, end - begin);
+}
+#endif
 
-  if (const char * env_p = std::getenv("ADDITIONAL_MEMPOOL_SIZE")) {
-    ADDITIONAL_MEMPOOL_SIZE = std::stoull(std::string(env_p));
+// clears the size bytes at ptr except the clean ranges.
+static void clear_dirty_ranges(void * ptr, size_t size, CleanRanges & clean)
+{
+  // sorted by begin, as there are only a few
+  for (size_t i = 1; i < clean.count; i++) {
+    for (size_t j = i; j > 0 && clean.ranges[j].begin < clean.ranges[j - 1].begin; j--) {
+      CleanRange range = clean.ranges[j];
+      clean.ranges[j] = clean.ranges[j - 1];
+      clean.ranges[j - 1] = range;
+    }
   }
 
-  mempool_ptr = (char *) mmap(
-    NULL, INITIAL_MEMPOOL_SIZE, PROT_READ | PROT_WRITE,
-    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  memset(mempool_ptr, 0, INITIAL_MEMPOOL_SIZE);
-  init_memory_pool(INITIAL_MEMPOOL_SIZE, mempool_ptr); // tlsf library function
+  char * dirty_begin = static_cast<char *>(ptr);
+  char * end = dirty_begin + size;
+  for (size_t i = 0; i < clean.count && dirty_begin < end; i++) {
+    char * clean_begin = clean.ranges[i].begin < end ? clean.ranges[i].begin : end;
+    if (dirty_begin < clean_begin) {
+      clear(dirty_begin, clean_begin);
+    }
+    if (clean.ranges[i].end > dirty_begin) {
+      dirty_begin = clean.ranges[i].end;
+    }
+  }
+  if (dirty_begin < end) {
+    clear(dirty_begin, end);
+  }
+}
 
-  // aligned2orig.reserve(10000000);
+// the caller holds the lock of the heap.
+static void free_block(Heap * heap, void * block_ptr)
+{
+  size_t size = block_size_of(block_ptr);
+  heap->used_bytes -= size;
+  heap->num_used_blocks--;
+  heap->freed_bytes += size;
+  free_ex(block_ptr, heap->pool);
 }
 
-// Do not use printf
-void check_mempool_initialized()
+// Multiple producers push without a lock, and the single consumer (the holder of the heap lock)
+// takes the whole list at once, so the list never suffers from ABA.
+static void push_remote_free(Heap * heap, void * block_ptr)
 {
-  if (mempool_initialized) {return;}
+  void * head = heap->remote_frees.load(std::memory_order_relaxed);
+  do {
+    *static_cast<void **>(block_ptr) = head;
+  } while (!heap->remote_frees.compare_exchange_weak(
+    head, block_ptr, std::memory_order_seq_cst, std::memory_order_relaxed));
+}
 
-  pthread_mutex_lock(&init_mtx);
+// the caller holds the lock of the heap.
+static void drain_remote_frees(Heap * heap)
+{
+  if (heap->remote_frees.load(std::memory_order_relaxed) == nullptr) {
+    return;
+  }
+  void * block_ptr = heap->remote_frees.exchange(nullptr, std::memory_order_acquire);
+  while (block_ptr != nullptr) {
+    void * next = *static_cast<void **>(block_ptr);
+    free_block(heap, block_ptr);
+    block_ptr = next;
+  }
+}
 
-  if (!mempool_init_started) {
-    mempool_init_started = true;
-    pthread_mutex_unlock(&init_mtx);
+// the caller holds the lock of the heap. picked up by the maintenance thread,
+// so that free never makes a system call.
+static void check_release_threshold(Heap * heap)
+{
+  if (RELEASE_THRESHOLD > 0 && heap->freed_bytes > RELEASE_THRESHOLD &&
+    !heap->release_requested.load(std::memory_order_relaxed))
+  {
+    heap->release_requested.store(true, std::memory_order_relaxed);
+  }
+}
 
-    initialize_mempool();
-    aligned2orig = new std::unordered_map<void *, void *>();
+// Calls visit(buffer, size) for each free block from first_buffer to the sentinel block.
+// The caller holds the lock of the heap.
+template<class F>
+static void for_each_free_block(char * first_buffer, F visit)
+{
+  char * buffer = first_buffer;
+  while (true) {
+    size_t word = header_word(buffer);
+    size_t size = word & BLOCK_SIZE_MASK;
+    if (size == 0) {
+      break; // sentinel block
+    }
+    if (word & FREE_BLOCK) {
+      visit(buffer, size);
+    }
+    buffer += size + BLOCK_OVERHEAD;
+  }
+}
 
-    mempool_initialized = true;
-    pthread_cond_signal(&init_cond);
-  } else {
-    while (!mempool_initialized) {
-      pthread_cond_wait(&init_cond, &init_mtx);
+// Calls visit(first_buffer, page_size) for each area of the heap.
+// The heap is locked one area at a time, so that allocations are not blocked for long.
+template<class F>
+static void for_each_area(Heap * heap, F visit)
+{
+  pthread_mutex_lock(&heap->mtx);
+  visit(heap->first_buffer, mempool_page_size);
+  pthread_mutex_unlock(&heap->mtx);
+
+  size_t n = num_areas.load(std::memory_order_acquire);
+  for (size_t i = 0; i < n; i++) {
+    if (areas[i].heap != heap) {
+      continue;
     }
+    // the first block of an added area holds the area information and is never free
+    pthread_mutex_lock(&heap->mtx);
+    visit(areas[i].begin + BLOCK_OVERHEAD, areas[i].page_size);
+    pthread_mutex_unlock(&heap->mtx);
+  }
+}
 
-    pthread_mutex_unlock(&init_mtx);
+// Called right after the initial slice of the heap was probed for first_buffer.
+// The probe wrote the free list links of its block, the header of the block after it and the
+// free list links of that block, which were merged into the single free block.
+static void init_clean_ranges(Heap * heap)
+{
+  for_each_free_block(
+    heap->first_buffer, [heap](char * buffer, size_t size) {
+      char * begin = buffer + 2 * FREE_LIST_LINKS_SIZE + BLOCK_OVERHEAD;
+      if (begin < buffer + size) {
+        add_clean_range(heap, begin, buffer + size);
+      }
+    });
+}
+
+// Gives the pages inside the free blocks of the heap back to the OS, keeping pad bytes of them.
+// This is never called on the allocation path.
+static size_t release_free_pages(Heap * heap, size_t pad)
+{
+  if (PREFAULT_POLICY == PrefaultPolicy::Lock) {
+    return 0; // madvise cannot release locked pages
+  }
+
+  pthread_mutex_lock(&heap->mtx);
+  drain_remote_frees(heap);
+  heap->freed_bytes = 0;
+  pthread_mutex_unlock(&heap->mtx);
+
+  size_t released = 0;
+  for_each_area(
+    heap, [heap, &released, &pad](char * first_buffer, size_t page_size) {
+      for_each_free_block(
+        first_buffer, [heap, &released, &pad, page_size](char * buffer, size_t size) {
+          // the free list links at the head of the buffer must stay
+          uintptr_t begin = (reinterpret_cast<uintptr_t>(buffer) + FREE_LIST_LINKS_SIZE +
+          page_size - 1) & ~(page_size - 1);
+          uintptr_t end = reinterpret_cast<uintptr_t>(buffer + size) & ~(page_size - 1);
+          if (end <= begin) {
+            return;
+          }
+          size_t length = end - begin;
+          if (pad >= length) {
+            pad -= length;
+          } else if (madvise(reinterpret_cast<void *>(begin), length, RELEASE_ADVICE) == 0) {
+            pad = 0;
+            released += length;
+            if (RELEASE_ADVICE == MADV_DONTNEED) {
+              // MADV_FREE may keep the old contents
+              add_clean_range(
+                heap, reinterpret_cast<char *>(begin), reinterpret_cast<char *>(end));
+            }
+          }
+        });
+    });
+
+  if (VERBOSE && released > 0) {
+    write_to_stderr(
+      "TLSF memory pool: ", released, " bytes returned to the OS, RSS ", get_rss_bytes(),
+      " bytes.\n");
+  }
+  return released;
+}
+
+// Adds a mapped area to the heap. The caller holds the lock of the heap.
+static void add_area(Heap * heap, char * addr, size_t size, size_t page_size)
+{
+  register_area(addr, size, heap, page_size);
+  add_new_area(addr, size - sysconf(_SC_PAGESIZE), heap->pool); // tlsf library function
+  heap->mapped_bytes += size;
+
+  // the area has a single free block, which has never been written beyond its free list links
+  for_each_free_block(
+    addr + BLOCK_OVERHEAD, [heap](char * buffer, size_t size) {
+      add_clean_range(heap, buffer + FREE_LIST_LINKS_SIZE, buffer + size);
+    });
+}
+
+// the size of an area in which a request of size bytes surely fits
+static size_t area_size_for(size_t size)
+{
+  if (size > SIZE_MAX / 2) {
+    return SIZE_MAX; // cannot be mapped anyway
+  }
+  // the area information, the sentinel, the block header, the page kept out of the tlsf library
+  // and the rounding of the request up to its size class (at most 1/32 of it)
+  return size + size / 16 + 4 * sysconf(_SC_PAGESIZE);
+}
+
+// runs on the maintenance thread when the free bytes of the heap fall below LOW_WATERMARK
+static void grow_heap(Heap * heap)
+{
+  size_t size = ADDITIONAL_MEMPOOL_SIZE > LOW_WATERMARK ? ADDITIONAL_MEMPOOL_SIZE : LOW_WATERMARK;
+  size_t page_size;
+  char * addr = map_pool_area(size, page_size);
+  if (addr == nullptr) {
+    write_to_stderr("TLSF memory pool: failed to map ", size, " bytes in the background.\n");
+    return;
+  }
+
+  // the area is added before it is populated, so that allocations never wait for it
+  pthread_mutex_lock(&heap->mtx);
+  add_area(heap, addr, size, page_size);
+  pthread_mutex_unlock(&heap->mtx);
+  prefault_region(addr, size);
+
+  if (VERBOSE) {
+    write_to_stderr(
+      "TLSF memory pool: ", size, " bytes added in the background (", page_size,
+      "-byte pages).\n");
+  }
+}
+
+// reports the state of the exhausted heap and aborts. the caller holds the lock of the heap.
+[[noreturn]] static void abort_on_exhaustion(Heap * heap, size_t size)
+{
+  size_t largest_free_block = 0;
+  auto visit = [&largest_free_block](char *, size_t block_size) {
+      if (block_size > largest_free_block) {
+        largest_free_block = block_size;
+      }
+    };
+  for_each_free_block(heap->first_buffer, visit);
+  size_t n = num_areas.load(std::memory_order_acquire);
+  for (size_t i = 0; i < n; i++) {
+    if (areas[i].heap == heap) {
+      for_each_free_block(areas[i].begin + BLOCK_OVERHEAD, visit);
+    }
   }
+
+  write_to_stderr(
+    "TLSF memory pool exhausted: failed to allocate ", size, " bytes from heap ",
+    static_cast<size_t>(heap - heaps), " (", heap->mapped_bytes, " bytes mapped, ",
+    heap->used_bytes, " bytes in ", heap->num_used_blocks, " blocks used, largest free block ",
+    largest_free_block, " bytes).\n");
+  abort();
 }
 
+// size is the number of bytes requested from the tlsf library.
+// the parts of the block known to be zero are stored in clean if it is not null.
 template<class F>
-static void * tlsf_allocate_internal(F allocate)
+static void * tlsf_allocate_internal(
+  Heap * heap, size_t size, F allocate,
+  CleanRanges * clean = nullptr)
 {
-  pthread_mutex_lock(&tlsf_mtx);
+  pthread_mutex_lock(&heap->mtx);
 
-  void * ret = allocate();
+  drain_remote_frees(heap);
+  check_release_threshold(heap);
+  void * ret = allocate(heap->pool);
 
   size_t multiplier = 1;
   while (ret == NULL) {
-    char * addr = (char *) mmap(
-      NULL, multiplier * ADDITIONAL_MEMPOOL_SIZE, PROT_READ | PROT_WRITE,
-      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    add_new_area(addr, multiplier * ADDITIONAL_MEMPOOL_SIZE, mempool_ptr); // tlsf library function
-    fprintf(
-      stderr, "TLSF memory pool exhausted: %lu bytes additionally mmaped.\n",
-      multiplier * ADDITIONAL_MEMPOOL_SIZE);
-
-    ret = allocate();
+    if (EXHAUSTION_POLICY == ExhaustionPolicy::Abort) {
+      abort_on_exhaustion(heap, size);
+    }
+    if (EXHAUSTION_POLICY == ExhaustionPolicy::Fail) {
+      pthread_mutex_unlock(&heap->mtx);
+      num_failed_allocations.fetch_add(1, std::memory_order_relaxed);
+      return NULL;
+    }
+
+    // the area is mapped without the lock, so that the other threads of the heap keep going
+    pthread_mutex_unlock(&heap->mtx);
+
+    size_t area_size = multiplier * ADDITIONAL_MEMPOOL_SIZE;
+    if (area_size < area_size_for(size)) {
+      area_size = area_size_for(size);
+    }
+    size_t page_size;
+    char * addr = map_pool_area(area_size, page_size);
+    if (addr == nullptr) {
+      post_pool_event(area_size, 0);
+      return NULL;
+    }
+    prefault_region(addr, area_size);
+    post_pool_event(area_size, page_size);
+
+    pthread_mutex_lock(&heap->mtx);
+    add_area(heap, addr, area_size, page_size);
+    ret = allocate(heap->pool);
     multiplier *= 2;
   }
 
-  pthread_mutex_unlock(&tlsf_mtx);
+  take_clean_ranges(heap, ret, clean);
+  heap->used_bytes += block_size_of(ret);
+  heap->num_used_blocks++;
+  size_t block_bytes = heap->used_bytes + heap->num_used_blocks * BLOCK_OVERHEAD;
+  if (block_bytes > heap->peak_block_bytes) {
+    heap->peak_block_bytes = block_bytes;
+  }
+  bool below_watermark = LOW_WATERMARK > 0 &&
+    heap->mapped_bytes - heap->used_bytes < LOW_WATERMARK &&
+    !heap->grow_requested.load(std::memory_order_relaxed);
+  if (below_watermark) {
+    heap->grow_requested.store(true, std::memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&heap->mtx);
+
+  if (below_watermark) {
+    wake_maintenance_thread();
+  }
+  if (maintenance_thread_lost.load(std::memory_order_relaxed)) {
+    restart_maintenance_thread();
+  }
   return ret;
 }
 
+// allocates from the TLSF heaps, bypassing the slabs
+static void * tlsf_heap_malloc(size_t size)
+{
+  return tlsf_allocate_internal(
+    get_thread_heap(), size, [size](char * pool) {return malloc_ex(size, pool);});
+}
+
+// the call site heap for the call sites segregated by the classifier, the thread heap otherwise.
+// *learning_site is set as by CallsiteClassifier::segregated.
+static Heap * select_heap(CallsiteClassifier::Site ** learning_site)
+{
+  *learning_site = nullptr;
+  if (callsite_heap != nullptr &&
+    CallsiteClassifier::getInstance().segregated(heaphook::current_callsite(), learning_site))
+  {
+    return callsite_heap;
+  }
+  return get_thread_heap();
+}
+
 static void * tlsf_malloc_wrapped(size_t size)
 {
-  return tlsf_allocate_internal([size] {return tlsf_malloc(size);});
+  SlabAllocator & slab_allocator = SlabAllocator::getInstance();
+  if (size <= SlabAllocator::kMaxSize && slab_allocator.enabled()) {
+    if (void * ret = slab_allocator.alloc(size)) {
+      return ret;
+    }
+  }
+  if (MMAP_THRESHOLD > 0 && size >= MMAP_THRESHOLD) {
+    return large_malloc(size);
+  }
+  CallsiteClassifier::Site * learning_site;
+  void * ret = tlsf_allocate_internal(
+    select_heap(&learning_site), size, [size](char * pool) {return malloc_ex(size, pool);});
+  if (learning_site != nullptr && ret != NULL) {
+    CallsiteClassifier::getInstance().allocated(learning_site, ret);
+  }
+  return ret;
 }
 
 static void * tlsf_calloc_wrapped(size_t num, size_t size)
 {
-  return tlsf_allocate_internal([num, size] {return tlsf_calloc(num, size);});
+  SlabAllocator & slab_allocator = SlabAllocator::getInstance();
+  if (num * size <= SlabAllocator::kMaxSize && slab_allocator.enabled()) {
+    if (void * ret = slab_allocator.alloc(num * size)) {
+      memset(ret, 0, num * size);
+      return ret;
+    }
+  }
+  if (MMAP_THRESHOLD > 0 && num * size >= MMAP_THRESHOLD) {
+    return large_malloc(num * size, true);
+  }
+  // cleared outside the lock, and only where the block may have been written before
+  CleanRanges clean{};
+  CallsiteClassifier::Site * learning_site;
+  void * ret = tlsf_allocate_internal(
+    select_heap(&learning_site), num * size,
+    [num, size](char * pool) {return malloc_ex(num * size, pool);}, &clean);
+  if (ret != NULL) {
+    clear_dirty_ranges(ret, num * size, clean);
+    if (learning_site != nullptr) {
+      CallsiteClassifier::getInstance().allocated(learning_site, ret);
+    }
+  }
+  return ret;
 }
 
-static void * tlsf_realloc_wrapped(void * ptr, size_t new_size)
+static void * tlsf_aligned_malloc(size_t alignment, size_t size)
+{
+  if (alignment <= TLSF_ALIGNMENT) {
+    return tlsf_malloc_wrapped(size);
+  }
+
+  // the aligned pointer is TLSF_ALIGNMENT to alignment bytes after addr, so that every aligned
+  // block is tagged and realloc keeps its alignment.
+  // the tag needs a TLSF block, so slabs are not used.
+  size_t padded_size;
+  if (__builtin_add_overflow(size, alignment, &padded_size)) {
+    return nullptr;
+  }
+  char * addr = static_cast<char *>(tlsf_heap_malloc(padded_size));
+  if (addr == nullptr) {
+    return nullptr;
+  }
+  size_t offset = alignment - reinterpret_cast<uint64_t>(addr) % alignment;
+
+  // offset is a multiple of TLSF_ALIGNMENT, so there is room for the tag
+  char * aligned = addr + offset;
+  reinterpret_cast<size_t *>(aligned)[-2] = alignment;
+  reinterpret_cast<size_t *>(aligned)[-1] = offset | ALIGNED_TAG;
+  return aligned;
+}
+
+// frees ptr, which was not allocated from the memory pool
+static void free_outside_pool(void * ptr)
+{
+  if (MMAP_THRESHOLD > 0) {
+    if (LargeBlock * block = large_block_of(ptr)) {
+      large_free(block);
+      return;
+    }
+  }
+  // allocated by glibc while the memory pool was being initialized
+  static free_type original_free = reinterpret_cast<free_type>(dlsym(RTLD_NEXT, "free"));
+  original_free(ptr);
+}
+
+static void free_in_heap(Heap * heap, void * ptr)
 {
-  return tlsf_allocate_internal([ptr, new_size] {return tlsf_realloc(ptr, new_size);});
+  if (callsite_heap != nullptr) {
+    CallsiteClassifier::getInstance().deallocated(ptr);
+  }
+  void * block_ptr = block_ptr_of(ptr);
+  if (!REMOTE_FREE) {
+    pthread_mutex_lock(&heap->mtx);
+    free_block(heap, block_ptr);
+  } else if ((heap != thread_heap && heap != callsite_heap) ||  // the call site heap is shared
+    pthread_mutex_trylock(&heap->mtx) != 0)
+  {
+    // freed by the threads of the heap on their next allocation
+    push_remote_free(heap, block_ptr);
+    if (heap->num_threads.load() != 0) {
+      return;
+    }
+    // the last thread of the heap has left it before the push
+    pthread_mutex_lock(&heap->mtx);
+  } else {
+    free_block(heap, block_ptr);
+  }
+  drain_remote_frees(heap);
+  check_release_threshold(heap);
+  pthread_mutex_unlock(&heap->mtx);
 }
 
 static void tlsf_free_wrapped(void * ptr)
 {
-  pthread_mutex_lock(&tlsf_mtx);
-  tlsf_free(ptr);
-  pthread_mutex_unlock(&tlsf_mtx);
+  SlabAllocator & slab_allocator = SlabAllocator::getInstance();
+  if (slab_allocator.contains(ptr)) {
+    slab_allocator.dealloc(ptr);
+    return;
+  }
+
+  Heap * heap = find_heap(ptr);
+  if (heap == nullptr) {
+    free_outside_pool(ptr);
+    return;
+  }
+  free_in_heap(heap, ptr);
 }
 
-static void * tlsf_aligned_malloc(size_t alignment, size_t size)
+// tlsf_free_wrapped, given the size and alignment ptr was allocated with (sized operator delete,
+// free_sized). a block of more than SlabAllocator::kMaxSize bytes never lies in the slab arena,
+// and a block of MMAP_THRESHOLD bytes or more is a mapping unless it was allocated by glibc, so
+// the search of the pools is skipped for it.
+static void tlsf_free_sized(void * ptr, size_t size, size_t alignment)
 {
-  void * addr = tlsf_malloc_wrapped(alignment + size);
-  void * aligned =
-    reinterpret_cast<void *>(reinterpret_cast<uint64_t>(addr) + alignment -
-    reinterpret_cast<uint64_t>(addr) % alignment);
-  (*aligned2orig)[aligned] = addr;
+  if (size <= SlabAllocator::kMaxSize) {
+    tlsf_free_wrapped(ptr);
+    return;
+  }
+
+  if (MMAP_THRESHOLD > 0 && size >= MMAP_THRESHOLD && alignment <= TLSF_ALIGNMENT) {
+    if (LargeBlock * block = large_block_of(ptr)) {
+      large_free(block);
+      return;
+    }
+  }
 
-  //printf("In tlsf_aligned_malloc: orig=%p -> aligned=%p\n", addr, aligned);
+  Heap * heap = find_heap(ptr);
+  if (heap == nullptr) {
+    free_outside_pool(ptr);
+    return;
+  }
+  free_in_heap(heap, ptr);
+}
 
-  return aligned;
+static void * tlsf_realloc_wrapped(void * ptr, size_t new_size)
+{
+  SlabAllocator & slab_allocator = SlabAllocator::getInstance();
+  if (slab_allocator.contains(ptr)) {
+    size_t old_size = slab_allocator.get_block_size(ptr);
+    if (new_size <= old_size) {
+      return ptr;
+    }
+    void * ret = tlsf_malloc_wrapped(new_size);
+    if (ret != nullptr) {
+      memcpy(ret, ptr, old_size);
+      slab_allocator.dealloc(ptr);
+    }
+    return ret;
+  }
+
+  Heap * heap = find_heap(ptr);
+  if (heap == nullptr) {
+    if (MMAP_THRESHOLD > 0) {
+      if (LargeBlock * block = large_block_of(ptr)) {
+        if (new_size >= MMAP_THRESHOLD) {
+          return large_realloc(block, new_size);
+        }
+        // shrunk below the threshold, back into the pool
+        void * ret = tlsf_malloc_wrapped(new_size);
+        if (ret != nullptr) {
+          memcpy(ret, ptr, new_size);
+          large_free(block);
+        }
+        return ret;
+      }
+    }
+    // allocated by glibc while the memory pool was being initialized
+    static realloc_type original_realloc =
+      reinterpret_cast<realloc_type>(dlsym(RTLD_NEXT, "realloc"));
+    return original_realloc(ptr, new_size);
+  }
+  if (callsite_heap != nullptr) {
+    CallsiteClassifier::getInstance().deallocated(ptr);
+  }
+
+  size_t word = header_word(ptr);
+  if (is_aligned_tag(word)) {
+    // keep the alignment of the block
+    size_t old_size = usable_size_of(ptr);
+    if (new_size <= old_size) {
+      return ptr;
+    }
+    size_t alignment = reinterpret_cast<size_t *>(ptr)[-2];
+    void * ret = tlsf_aligned_malloc(alignment, new_size);
+    if (ret != nullptr) {
+      memcpy(ret, ptr, old_size);
+      tlsf_free_wrapped(ptr);
+    }
+    return ret;
+  }
+
+  if (MMAP_THRESHOLD > 0 && new_size >= MMAP_THRESHOLD) {
+    // copied once into a mapping, which grows without copying from then on
+    void * ret = large_malloc(new_size);
+    if (ret != nullptr) {
+      size_t old_size = usable_size_of(ptr);
+      memcpy(ret, ptr, old_size < new_size ? old_size : new_size);
+      tlsf_free_wrapped(ptr);
+    }
+    return ret;
+  }
+
+  return tlsf_allocate_internal(
+    heap, new_size, [heap, ptr, new_size](char * pool) {
+      size_t old_size = block_size_of(ptr);
+      void * ret = realloc_ex(ptr, new_size, pool);
+      if (ret != NULL) {
+        heap->used_bytes -= old_size;
+        heap->num_used_blocks--;
+      }
+      return ret;
+    });
 }
 
 using namespace heaphook;
@@ -193,44 +2360,100 @@ class TlfsAllocator : public GlobalAllocator
 
     free_no_hook = true;
     check_mempool_initialized();
+    tlsf_free_wrapped(ptr);
+    free_no_hook = false;
+  }
+
+  void do_dealloc_sized(void * ptr, size_t size, size_t align) override
+  {
+    static free_type original_free = reinterpret_cast<free_type>(dlsym(RTLD_NEXT, "free"));
+    static __thread bool free_no_hook = false;
+
+    if (free_no_hook) {
+      if (mempool_initialized) {
+        tlsf_free_sized(ptr, size, align);
+      } else {
+        original_free(ptr);
+      }
 
-    auto it = aligned2orig->find(ptr);
-    if (it != aligned2orig->end()) {
-      ptr = it->second;
-      aligned2orig->erase(it);
+      return;
     }
 
-    tlsf_free_wrapped(ptr);
+    free_no_hook = true;
+    check_mempool_initialized();
+    tlsf_free_sized(ptr, size, align);
     free_no_hook = false;
   }
 
   size_t do_get_block_size(void * ptr) override
   {
-    //               |--------------------|
-    //               |      prev_hdr      |
-    //               |--------------------|
-    //               |        size      |U|
-    //               |--------------------| -+
-    // block_ptr --> |                    |  |
-    //               |--------------------|  | unused size
-    //               |                    |  |
-    //               |--------------------| -+
-    //   buf_ptr --> |       buffer       |
-    //               |--------------------|
-    void * buf_ptr = ptr;
-    size_t buf_addr = reinterpret_cast<size_t>(buf_ptr);
-    auto it = aligned2orig->find(ptr);
-    if (it != aligned2orig->end()) {
-      // If block is aligned, ptr does not point to the beginning of the block.
-      void * block_ptr = it->second;
-      size_t block_addr = reinterpret_cast<size_t>(block_ptr);
-      size_t block_size = (*reinterpret_cast<size_t *>(block_addr - 8)) & (~0b1111ull);
-      size_t unused_size = buf_addr - block_addr;
-      return block_size - unused_size;
-    } else {
-      size_t block_size = (*reinterpret_cast<size_t *>(buf_addr - 8)) & (~0b1111ull);
-      return block_size;
+    SlabAllocator & slab_allocator = SlabAllocator::getInstance();
+    if (slab_allocator.contains(ptr)) {
+      return slab_allocator.get_block_size(ptr);
+    }
+    if (find_heap(ptr) == nullptr) {
+      if (MMAP_THRESHOLD > 0) {
+        if (LargeBlock * block = large_block_of(ptr)) {
+          return large_usable_size(block);
+        }
+      }
+      // allocated by glibc while the memory pool was being initialized
+      static malloc_usable_size_type original_malloc_usable_size =
+        reinterpret_cast<malloc_usable_size_type>(dlsym(RTLD_NEXT, "malloc_usable_size"));
+      return original_malloc_usable_size(ptr);
+    }
+    return usable_size_of(ptr);
+  }
+
+  int do_trim(size_t pad) override
+  {
+    if (!mempool_initialized) {
+      return 0;
+    }
+    size_t released = 0;
+    for (size_t i = 0; i < NUM_HEAPS; i++) {
+      released += release_free_pages(&heaps[i], pad);
+    }
+    if (MMAP_CACHE_SIZE > 0) {
+      released += release_cached_mappings();
+    }
+    return released > 0;
+  }
+
+  bool do_get_stats(AllocatorStats & stats, bool) override
+  {
+    if (!mempool_initialized) {
+      return false;
+    }
+
+    for (size_t i = 0; i < NUM_HEAPS; i++) {
+      Heap & heap = heaps[i];
+      pthread_mutex_lock(&heap.mtx);
+      drain_remote_frees(&heap);
+      stats.mapped_bytes += heap.mapped_bytes;
+      stats.used_bytes += heap.used_bytes;
+      stats.peak_used_bytes += heap.peak_block_bytes; // the sum of the peaks of the heaps
+      stats.num_used_blocks += heap.num_used_blocks;
+      pthread_mutex_unlock(&heap.mtx);
+    }
+
+    // a large block carries a header as large as that of a TLSF block
+    size_t num_large = num_large_blocks.load(std::memory_order_relaxed);
+    size_t large_mapped = large_mapped_bytes.load(std::memory_order_relaxed);
+    stats.mapped_bytes += large_mapped + cached_mapping_bytes.load(std::memory_order_relaxed);
+    stats.used_bytes += large_mapped - num_large * sizeof(LargeBlock);
+    stats.num_used_blocks += num_large;
+
+    size_t n = num_areas.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; i++) {
+      stats.added_area_bytes += areas[i].end - areas[i].begin;
     }
+    stats.num_added_areas = n;
+    stats.block_overhead = BLOCK_OVERHEAD;
+
+    size_t used = stats.used_bytes + stats.num_used_blocks * BLOCK_OVERHEAD;
+    stats.free_bytes = stats.mapped_bytes > used ? stats.mapped_bytes - used : 0;
+    return true;
   }
 
   void * do_alloc_zeroed(size_t size) override
@@ -270,13 +2493,6 @@ class TlfsAllocator : public GlobalAllocator
 
     realloc_no_hook = true;
     check_mempool_initialized();
-
-    auto it = aligned2orig->find(ptr);
-    if (it != aligned2orig->end()) {
-      ptr = it->second;
-      aligned2orig->erase(ptr);
-    }
-
     void * ret = tlsf_realloc_wrapped(ptr, new_size);
     realloc_no_hook = false;
     return ret;
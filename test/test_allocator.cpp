@@ -8,7 +8,14 @@
 #include <thread>
 #include <random>
 #include <set>
-
+#include <atomic>
+#include <chrono>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <memory_resource>
+
+#include "heaphook/arena_resource.hpp"
 #include "heaphook/heaphook.hpp"
 #include "heaphook/utils.hpp"
 
@@ -106,6 +113,18 @@ TEST(alloc_zeroed_test, valid_size_test) {
 //   test(SIZE_MAX);
 // }
 
+TEST(alloc_zeroed_test, reuse_test) {
+  // a freed buffer may be handed out again, and must still be cleared
+  const size_t size = 4 * 1024 * 1024;
+  for (int i = 0; i < 3; i++) {
+    char * ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc_zeroed(size));
+    ASSERT_TRUE(ptr != nullptr);
+    EXPECT_EQ(std::count(ptr, ptr + size, 0), static_cast<ptrdiff_t>(size));
+    memset(ptr, 0xff, size);
+    GlobalAllocator::get_instance().dealloc(ptr);
+  }
+}
+
 TEST(realloc_test, alloc_to_realloc_test) {
   auto test = [](size_t old_size, size_t new_size) {
       char * ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(old_size));
@@ -177,6 +196,35 @@ TEST(realloc_test, realloc_to_realloc_test) {
   test(getpagesize(), 123);
 }
 
+TEST(realloc_test, large_growth_test) {
+  // grows like a std::vector of points, through sizes served by mappings where enabled
+  size_t size = 4096;
+  char * ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(size));
+  ASSERT_TRUE(ptr != nullptr);
+  memset(ptr, 1, size);
+  while (size < 64 * 1024 * 1024) {
+    size_t new_size = size * 2;
+    ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().realloc(ptr, new_size));
+    ASSERT_TRUE(ptr != nullptr);
+    EXPECT_EQ(ptr[0], 1);
+    EXPECT_EQ(ptr[size - 1], 1);
+    size_t block_size = GlobalAllocator::get_instance().get_block_size(ptr);
+    EXPECT_LE(new_size, block_size);
+    memset(ptr, 1, block_size); // the whole usable size is writable
+    size = new_size;
+  }
+  ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().realloc(ptr, 100));
+  ASSERT_TRUE(ptr != nullptr);
+  EXPECT_EQ(ptr[99], 1);
+  GlobalAllocator::get_instance().dealloc(ptr);
+
+  char * zeroed = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc_zeroed(size));
+  ASSERT_TRUE(zeroed != nullptr);
+  EXPECT_EQ(zeroed[0], 0);
+  EXPECT_EQ(zeroed[size - 1], 0);
+  GlobalAllocator::get_instance().dealloc(zeroed);
+}
+
 // TEST(realloc_test, too_big_size_test) {
 //   void *ptr = GlobalAllocator::get_instance().alloc(100, 64);
 //   EXPECT_TRUE(ptr != nullptr);
@@ -251,3 +299,401 @@ TEST(integration_test, multi_thread_test) {
     ASSERT_EQ(*alloc_ptrs[1][i], 1);
   }
 }
+
+TEST(integration_test, cross_thread_dealloc_test) {
+  const size_t ALLOCATION_COUNT = 10000;
+  const size_t NUM_THREADS = 4;
+
+  auto thread_func = [](void ** alloc_ptrs, size_t thread_id) {
+      std::random_device rd;
+      std::mt19937 gen(rd());
+      std::uniform_int_distribution<size_t> distribution(sizeof(size_t), 2 * getpagesize());
+
+      for (size_t i = 0; i < ALLOCATION_COUNT; i++) {
+        auto ptr = GlobalAllocator::get_instance().alloc(distribution(gen));
+        ASSERT_TRUE(ptr != nullptr);
+        *reinterpret_cast<size_t *>(ptr) = thread_id;
+        alloc_ptrs[i] = ptr;
+      }
+    };
+
+  std::vector<std::vector<void *>> alloc_ptrs(NUM_THREADS, std::vector<void *>(ALLOCATION_COUNT));
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    threads.emplace_back(thread_func, alloc_ptrs[i].data(), i);
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+
+  // blocks are freed by a thread other than the one which allocated them.
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    for (auto ptr : alloc_ptrs[i]) {
+      ASSERT_EQ(*reinterpret_cast<size_t *>(ptr), i);
+      GlobalAllocator::get_instance().dealloc(ptr);
+    }
+  }
+}
+
+// a benchmark of threads allocating and freeing at the same time, which contend for the lock of
+// a shared heap unless each thread has a heap of its own (e.g. TLSF_THREAD_HEAPS).
+TEST(integration_test, contention_test) {
+  const size_t OPERATION_COUNT = 200000;
+  const size_t WINDOW_SIZE = 64;
+  const size_t MAX_THREADS = 8;
+
+  auto thread_func = [](size_t thread_id) {
+      void * window[WINDOW_SIZE] = {};
+      for (size_t i = 0; i < OPERATION_COUNT; i++) {
+        void *& slot = window[i % WINDOW_SIZE];
+        if (slot != nullptr) {
+          ASSERT_EQ(*reinterpret_cast<size_t *>(slot), thread_id);
+          GlobalAllocator::get_instance().dealloc(slot);
+        }
+        slot = GlobalAllocator::get_instance().alloc(16 + (i * 7919) % 1024);
+        ASSERT_TRUE(slot != nullptr);
+        *reinterpret_cast<size_t *>(slot) = thread_id;
+      }
+      for (auto ptr : window) {
+        GlobalAllocator::get_instance().dealloc(ptr);
+      }
+    };
+
+  auto run = [&thread_func](size_t num_threads) {
+      std::vector<std::thread> threads;
+      for (size_t i = 0; i < num_threads; i++) {
+        threads.emplace_back(thread_func, i);
+      }
+      for (auto & t : threads) {
+        t.join();
+      }
+    };
+
+  // glibc keeps the stacks of exited threads with their TLS, allocated on the first run
+  run(MAX_THREADS);
+  AllocatorStats before;
+  bool has_stats = GlobalAllocator::get_instance().get_stats(before, false);
+
+  for (size_t num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2) {
+    auto start_time = std::chrono::steady_clock::now();
+    run(num_threads);
+    auto end_time = std::chrono::steady_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time);
+    // falls with the number of threads as far as they run in parallel
+    std::cout << "contention_test: " << num_threads << " threads: " <<
+      duration.count() / (OPERATION_COUNT * num_threads) << " ns per alloc and dealloc" <<
+      std::endl;
+  }
+
+  AllocatorStats after;
+  if (has_stats && GlobalAllocator::get_instance().get_stats(after, false)) {
+    EXPECT_EQ(after.num_used_blocks, before.num_used_blocks);
+  }
+}
+
+// with TLSF_THREAD_POOLS=heaphook_rt=..., the blocks allocated after the thread names itself come
+// from a dedicated pool, and are still freed to it by the main thread.
+TEST(integration_test, named_thread_test) {
+  const size_t ALLOCATION_COUNT = 1000;
+
+  std::vector<void *> alloc_ptrs(2 * ALLOCATION_COUNT);
+  std::thread thread([&alloc_ptrs]() {
+      for (size_t i = 0; i < 2 * ALLOCATION_COUNT; i++) {
+        if (i == ALLOCATION_COUNT) {
+          ASSERT_EQ(pthread_setname_np(pthread_self(), "heaphook_rt"), 0);
+        }
+        auto ptr = GlobalAllocator::get_instance().alloc(64 + i);
+        ASSERT_TRUE(ptr != nullptr);
+        *reinterpret_cast<size_t *>(ptr) = i;
+        alloc_ptrs[i] = ptr;
+      }
+    });
+  thread.join();
+
+  for (size_t i = 0; i < 2 * ALLOCATION_COUNT; i++) {
+    ASSERT_EQ(*reinterpret_cast<size_t *>(alloc_ptrs[i]), i);
+    EXPECT_LE(64 + i, GlobalAllocator::get_instance().get_block_size(alloc_ptrs[i]));
+    GlobalAllocator::get_instance().dealloc(alloc_ptrs[i]);
+  }
+}
+
+// a benchmark of the pipeline pattern: messages are allocated by a producer thread and freed by
+// a consumer thread, while the producer keeps allocating.
+TEST(integration_test, producer_consumer_test) {
+  const size_t MESSAGE_COUNT = 1000000;
+  const size_t RING_SIZE = 1024;
+  const size_t MESSAGE_SIZE = 1024;
+
+  std::vector<std::atomic<void *>> ring(RING_SIZE);
+  for (auto & slot : ring) {
+    slot.store(nullptr, std::memory_order_relaxed);
+  }
+
+  AllocatorStats before;
+  bool has_stats = GlobalAllocator::get_instance().get_stats(before, false);
+
+  auto start_time = std::chrono::steady_clock::now();
+  std::thread producer([&ring]() {
+      for (size_t i = 0; i < MESSAGE_COUNT; i++) {
+        auto ptr = GlobalAllocator::get_instance().alloc(MESSAGE_SIZE);
+        ASSERT_TRUE(ptr != nullptr);
+        *reinterpret_cast<size_t *>(ptr) = i;
+        auto & slot = ring[i % RING_SIZE];
+        while (slot.load(std::memory_order_acquire) != nullptr) {
+          std::this_thread::yield();
+        }
+        slot.store(ptr, std::memory_order_release);
+      }
+    });
+  std::thread consumer([&ring]() {
+      for (size_t i = 0; i < MESSAGE_COUNT; i++) {
+        auto & slot = ring[i % RING_SIZE];
+        void * ptr;
+        while ((ptr = slot.load(std::memory_order_acquire)) == nullptr) {
+          std::this_thread::yield();
+        }
+        slot.store(nullptr, std::memory_order_release);
+        ASSERT_EQ(*reinterpret_cast<size_t *>(ptr), i);
+        GlobalAllocator::get_instance().dealloc(ptr);
+      }
+    });
+  producer.join();
+  consumer.join();
+  auto end_time = std::chrono::steady_clock::now();
+
+  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time);
+  std::cout << "producer_consumer_test: " << duration.count() / MESSAGE_COUNT <<
+    " ns per message" << std::endl;
+
+  // every message has been returned to the allocator
+  AllocatorStats after;
+  if (has_stats && GlobalAllocator::get_instance().get_stats(after, false)) {
+    EXPECT_EQ(after.num_used_blocks, before.num_used_blocks);
+  }
+}
+
+// measures the worst-case latency of alloc and dealloc on threads running with SCHED_FIFO,
+// while the threads keep a window of live blocks of random sizes.
+TEST(latency_test, sched_fifo_test) {
+  const size_t NUM_THREADS = 2;
+  const size_t ITERATION_COUNT = 200000;
+  const size_t WINDOW_SIZE = 256;
+
+  struct Latency
+  {
+    uint64_t max_alloc_ns = 0;
+    uint64_t max_dealloc_ns = 0;
+    bool ok = true;
+  };
+
+  auto thread_func = [](void * arg) -> void * {
+      auto now_ns = []() {
+          struct timespec ts;
+          clock_gettime(CLOCK_MONOTONIC, &ts);
+          return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+        };
+      auto latency = static_cast<Latency *>(arg);
+      void * window[WINDOW_SIZE] = {};
+      uint64_t seed = reinterpret_cast<uintptr_t>(arg);
+      for (size_t i = 0; i < ITERATION_COUNT; i++) {
+        // no allocation from the random number generator inside the measured loop
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        size_t size = 16 + (seed >> 33) % 4096;
+        void *& slot = window[i % WINDOW_SIZE];
+
+        if (slot != nullptr) {
+          uint64_t begin = now_ns();
+          GlobalAllocator::get_instance().dealloc(slot);
+          uint64_t elapsed = now_ns() - begin;
+          latency->max_dealloc_ns = std::max(latency->max_dealloc_ns, elapsed);
+        }
+
+        uint64_t begin = now_ns();
+        slot = GlobalAllocator::get_instance().alloc(size);
+        uint64_t elapsed = now_ns() - begin;
+        latency->max_alloc_ns = std::max(latency->max_alloc_ns, elapsed);
+        if (slot == nullptr) {
+          latency->ok = false;
+          break;
+        }
+        memset(slot, 0, size);
+      }
+      for (auto ptr : window) {
+        if (ptr != nullptr) {
+          GlobalAllocator::get_instance().dealloc(ptr);
+        }
+      }
+      return nullptr;
+    };
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  struct sched_param param;
+  param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 1;
+  pthread_attr_setschedparam(&attr, &param);
+
+  Latency latencies[NUM_THREADS];
+  pthread_t threads[NUM_THREADS];
+  size_t num_started = 0;
+  for (; num_started < NUM_THREADS; num_started++) {
+    if (pthread_create(&threads[num_started], &attr, thread_func, &latencies[num_started]) != 0) {
+      break;
+    }
+  }
+  pthread_attr_destroy(&attr);
+  for (size_t i = 0; i < num_started; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  if (num_started < NUM_THREADS) {
+    GTEST_SKIP() << "SCHED_FIFO is not permitted";
+  }
+
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    EXPECT_TRUE(latencies[i].ok);
+    std::cout << "sched_fifo_test: thread " << i << ": max alloc " <<
+      latencies[i].max_alloc_ns << " ns, max dealloc " << latencies[i].max_dealloc_ns <<
+      " ns" << std::endl;
+  }
+}
+
+TEST(trim_test, live_blocks_test) {
+  const size_t ALLOCATION_COUNT = 256;
+  const size_t ALLOCATION_SIZE = 4 * getpagesize();
+
+  std::vector<char *> ptrs;
+  for (size_t i = 0; i < ALLOCATION_COUNT; i++) {
+    auto ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(ALLOCATION_SIZE));
+    ASSERT_TRUE(ptr != nullptr);
+    memset(ptr, static_cast<int>(i & 0xff), ALLOCATION_SIZE);
+    ptrs.push_back(ptr);
+  }
+
+  // counts the resident pages inside the blocks freed below. the first and the last page of
+  // each may hold the allocator's metadata, so they are not counted.
+  auto count_resident_pages = [&]() {
+      size_t page_size = getpagesize();
+      size_t resident_pages = 0;
+      for (size_t i = 0; i < ALLOCATION_COUNT; i += 2) {
+        uintptr_t begin = (reinterpret_cast<uintptr_t>(ptrs[i]) / page_size + 1) * page_size;
+        uintptr_t end = (reinterpret_cast<uintptr_t>(ptrs[i]) + ALLOCATION_SIZE) / page_size *
+          page_size;
+        unsigned char residency[4];
+        if (mincore(reinterpret_cast<void *>(begin), end - begin, residency) == 0) {
+          for (size_t j = 0; j < (end - begin) / page_size; j++) {
+            resident_pages += residency[j] & 1;
+          }
+        }
+      }
+      return resident_pages;
+    };
+  size_t resident_pages = count_resident_pages();
+  EXPECT_GT(resident_pages, 0u);
+
+  // free every other block, so that the free blocks are surrounded by live ones
+  for (size_t i = 0; i < ALLOCATION_COUNT; i += 2) {
+    GlobalAllocator::get_instance().dealloc(ptrs[i]);
+  }
+  const char * release_advice = std::getenv("TLSF_RELEASE_ADVICE");
+  bool lazy_release = release_advice != nullptr && strcmp(release_advice, "free") == 0;
+  if (GlobalAllocator::get_instance().trim(0) == 1 && !lazy_release) {
+    // most of the pages inside the freed blocks are no longer resident. MADV_FREE leaves them
+    // resident until the kernel needs memory.
+    EXPECT_LE(count_resident_pages() * 16, resident_pages);
+  }
+
+  for (size_t i = 1; i < ALLOCATION_COUNT; i += 2) {
+    for (size_t j = 0; j < ALLOCATION_SIZE; j++) {
+      ASSERT_EQ(ptrs[i][j], static_cast<char>(i & 0xff));
+    }
+    GlobalAllocator::get_instance().dealloc(ptrs[i]);
+  }
+
+  // released memory can be allocated again
+  for (size_t i = 0; i < ALLOCATION_COUNT; i++) {
+    auto ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(ALLOCATION_SIZE));
+    ASSERT_TRUE(ptr != nullptr);
+    memset(ptr, 1, ALLOCATION_SIZE);
+    ptrs[i] = ptr;
+  }
+  for (auto ptr : ptrs) {
+    GlobalAllocator::get_instance().dealloc(ptr);
+  }
+}
+
+TEST(stats_test, used_bytes_test) {
+  const size_t ALLOCATION_SIZE = 1024 * 1024;
+
+  AllocatorStats before;
+  if (!GlobalAllocator::get_instance().get_stats(before, false)) {
+    GTEST_SKIP() << "the allocator does not keep statistics";
+  }
+
+  auto ptr = GlobalAllocator::get_instance().alloc(ALLOCATION_SIZE);
+  ASSERT_TRUE(ptr != nullptr);
+  AllocatorStats during;
+  ASSERT_TRUE(GlobalAllocator::get_instance().get_stats(during, true));
+  EXPECT_GE(during.used_bytes, before.used_bytes + ALLOCATION_SIZE);
+  EXPECT_EQ(during.num_used_blocks, before.num_used_blocks + 1);
+  EXPECT_GE(during.peak_used_bytes, during.used_bytes);
+  EXPECT_LE(during.used_bytes + during.free_bytes, during.mapped_bytes);
+
+  GlobalAllocator::get_instance().dealloc(ptr);
+  AllocatorStats after;
+  ASSERT_TRUE(GlobalAllocator::get_instance().get_stats(after, false));
+  EXPECT_EQ(after.used_bytes, before.used_bytes);
+  EXPECT_EQ(after.num_used_blocks, before.num_used_blocks);
+}
+
+TEST(arena_test, reset_test) {
+  const size_t CHUNK_SIZE = 4096;
+
+  heaphook_arena_t * arena = heaphook_arena_create(CHUNK_SIZE);
+  ASSERT_TRUE(arena != nullptr);
+
+  std::vector<void *> first_round;
+  for (size_t i = 0; i < 100; i++) {
+    size_t alignment = 8 << (i % 4);
+    void * ptr = heaphook_arena_alloc(arena, 100, alignment);
+    ASSERT_TRUE(ptr != nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % alignment, 0u);
+    memset(ptr, 'A', 100);
+    first_round.push_back(ptr);
+  }
+  void * large = heaphook_arena_alloc(arena, CHUNK_SIZE * 4, 0);
+  ASSERT_TRUE(large != nullptr);
+  memset(large, 'B', CHUNK_SIZE * 4);
+  EXPECT_EQ(heaphook_arena_alloc(arena, 1, 3), nullptr);
+
+  // the same requests after a reset reuse the same memory
+  AllocatorStats before;
+  bool has_stats = GlobalAllocator::get_instance().get_stats(before, false);
+  heaphook_arena_reset(arena);
+  for (size_t i = 0; i < 100; i++) {
+    EXPECT_EQ(heaphook_arena_alloc(arena, 100, 8 << (i % 4)), first_round[i]);
+  }
+  AllocatorStats after;
+  if (has_stats && GlobalAllocator::get_instance().get_stats(after, false)) {
+    EXPECT_EQ(after.num_used_blocks, before.num_used_blocks);
+  }
+
+  heaphook_arena_destroy(arena);
+}
+
+TEST(arena_test, memory_resource_test) {
+  heaphook::ArenaResource resource(1024);
+  ASSERT_TRUE(resource.uses_arena());
+
+  for (int round = 0; round < 10; round++) {
+    {
+      std::pmr::vector<int> values(&resource);
+      for (int i = 0; i < 1000; i++) {
+        values.push_back(i);
+      }
+      EXPECT_EQ(values[999], 999);
+    }
+    resource.reset();
+  }
+}
@@ -0,0 +1,75 @@
+#include <sys/wait.h>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <gtest/gtest.h>
+
+// runs backtrace_diff on two reports, and returns its exit status and output
+static int run_backtrace_diff(
+  const std::string & options, const std::string & before, const std::string & after,
+  std::string & output)
+{
+  std::string before_path = testing::TempDir() + "backtrace_diff_before.log";
+  std::string after_path = testing::TempDir() + "backtrace_diff_after.log";
+  std::ofstream(before_path) << before;
+  std::ofstream(after_path) << after;
+
+  std::string command = std::string(BACKTRACE_DIFF) + " " + options + " " + before_path + " " +
+    after_path;
+  FILE * fp = popen(command.c_str(), "r");
+  if (fp == nullptr) {
+    return -1;
+  }
+  char buf[256];
+  output.clear();
+  while (fgets(buf, sizeof(buf), fp) != nullptr) {
+    output += buf;
+  }
+  int status = pclose(fp);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+TEST(backtrace_diff_test, rebuilt_binary_test) {
+  // the same call sites, with other addresses and offsets as after a rebuild
+  const std::string before =
+    "Allocate 1000 bytes with 10 calls, causing 0 page faults, taking 100 ns (max 20 ns):\n"
+    "/lib/libheaphook.so(_Z5allocm+0x81) [0x712ae9355f61]\n"
+    "/usr/bin/node(+0x3fbef) [0x55d0c2a3dbef]\n"
+    "/usr/bin/node(_Z8callbackv+0x20) [0x55d0c2a3d000]\n"
+    "\n"
+    "Allocate 500 bytes with 5 calls, causing 0 page faults, taking 50 ns (max 20 ns):\n"
+    "/lib/libheaphook.so(_Z5allocm+0x81) [0x712ae9355f61]\n"
+    "/usr/bin/node(_Z5setupv+0x10) [0x55d0c2a3e000]\n";
+  const std::string after =
+    "Allocate 1000 bytes with 4 calls, causing 0 page faults, taking 40 ns (max 20 ns):\n"
+    "/lib/libheaphook.so(_Z5allocm+0x91) [0x7f0000001f71]\n"
+    "/usr/bin/node(+0x41c03) [0x5600000c1c03]\n"
+    "/usr/bin/node(_Z8callbackv+0x48) [0x560000001048]\n"
+    "\n"
+    "Allocate 500 bytes with 5 calls, causing 0 page faults, taking 50 ns (max 20 ns):\n"
+    "/lib/libheaphook.so(_Z5allocm+0x91) [0x7f0000001f71]\n"
+    "/usr/bin/node(_Z5setupv+0x18) [0x560000002018]\n";
+
+  std::string output;
+  ASSERT_EQ(run_backtrace_diff("--max-calls-increase 0", before, after, output), 0);
+  EXPECT_NE(output.find("over 2 call sites"), std::string::npos) << output;
+  EXPECT_NE(output.find("-6 calls, +0 page faults, -60 ns (calls: 10 -> 4)"), std::string::npos) <<
+    output;
+  EXPECT_NE(output.find("/lib/libheaphook.so(_Z5allocm)\n/usr/bin/node\n"), std::string::npos) <<
+    output;
+}
+
+TEST(backtrace_diff_test, regression_test) {
+  const std::string before =
+    "Allocate 100 bytes with 1 calls, causing 0 page faults, taking 10 ns (max 10 ns):\n"
+    "/usr/bin/node(_Z8callbackv+0x20) [0x55d0c2a3d000]\n";
+  const std::string after =
+    "Allocate 300 bytes with 3 calls, causing 0 page faults, taking 30 ns (max 10 ns):\n"
+    "/usr/bin/node(_Z8callbackv+0x28) [0x560000001028]\n";
+
+  std::string output;
+  EXPECT_EQ(run_backtrace_diff("--max-calls-increase 1", before, after, output), 1);
+  EXPECT_NE(output.find("REGRESSION +200 bytes, +2 calls"), std::string::npos) << output;
+  EXPECT_EQ(run_backtrace_diff("--max-calls-increase 2", before, after, output), 0);
+}
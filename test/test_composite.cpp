@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "heaphook/heaphook.hpp"
+#include "../src/tlsf/slab.hpp"
+
+using namespace heaphook;
+
+// tests of libpreloaded_composite specific behavior, built into test_preloaded_composite.
+// they assume the default sizes of the sub-allocators.
+
+static constexpr size_t SMALL_MAX = SlabAllocator::kMaxSize;
+static constexpr size_t LARGE_MIN = 1024 * 1024;
+
+enum class SubAllocator { Slab, Tlsf, Mapping };
+
+// a mapping is recognized by the cookie in its header, as in composite.cpp
+static SubAllocator sub_allocator_of(void * ptr)
+{
+  if (SlabAllocator::getInstance().contains(ptr)) {
+    return SubAllocator::Slab;
+  }
+  uintptr_t cookie = reinterpret_cast<uintptr_t *>(ptr)[-1];
+  if (cookie == (reinterpret_cast<uintptr_t>(ptr) ^ 0x636f6d706f736974ull)) {
+    return SubAllocator::Mapping;
+  }
+  return SubAllocator::Tlsf;
+}
+
+static bool default_sizes()
+{
+  for (const char * name : {"COMPOSITE_SMALL_MAX", "COMPOSITE_SLAB_ARENA_SIZE",
+      "COMPOSITE_POOL_SIZE", "COMPOSITE_LARGE_MIN"})
+  {
+    if (std::getenv(name) != nullptr) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TEST(composite_test, routing_test) {
+  if (!default_sizes()) {
+    GTEST_SKIP() << "the sizes of the sub-allocators are not the defaults";
+  }
+  struct Route
+  {
+    size_t size;
+    size_t align;
+    SubAllocator sub_allocator;
+  };
+  for (const Route & route : std::vector<Route>{
+      {1, 1, SubAllocator::Slab},
+      {SMALL_MAX, 1, SubAllocator::Slab},
+      {SMALL_MAX + 1, 1, SubAllocator::Tlsf},
+      {SMALL_MAX, 64, SubAllocator::Tlsf}, // slabs are aligned to TLSF_ALIGNMENT only
+      {LARGE_MIN - 1, 1, SubAllocator::Tlsf},
+      {LARGE_MIN, 1, SubAllocator::Mapping},
+      {LARGE_MIN, 4096, SubAllocator::Mapping},
+      {LARGE_MIN, 8192, SubAllocator::Tlsf}, // over the page size, which mappings support
+    })
+  {
+    void * ptr = GlobalAllocator::get_instance().alloc(route.size, route.align);
+    ASSERT_TRUE(ptr != nullptr);
+    EXPECT_EQ(sub_allocator_of(ptr), route.sub_allocator) << route.size << ", " << route.align;
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % route.align, 0u);
+    EXPECT_GE(GlobalAllocator::get_instance().get_block_size(ptr), route.size);
+    memset(ptr, 0xAA, route.size);
+    GlobalAllocator::get_instance().dealloc(ptr);
+  }
+}
+
+TEST(composite_test, realloc_test) {
+  if (!default_sizes()) {
+    GTEST_SKIP() << "the sizes of the sub-allocators are not the defaults";
+  }
+  auto ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(100));
+  ASSERT_TRUE(ptr != nullptr);
+  ASSERT_EQ(sub_allocator_of(ptr), SubAllocator::Slab);
+  for (size_t i = 0; i < 100; i++) {
+    ptr[i] = static_cast<char>(i);
+  }
+
+  // moved between the sub-allocators, the block keeps its contents up to the smallest size
+  struct Step
+  {
+    size_t new_size;
+    SubAllocator sub_allocator;
+  };
+  size_t size = 100;
+  size_t kept_size = 100;
+  for (const Step & step : std::vector<Step>{
+      {50, SubAllocator::Slab}, // shrunk in place
+      {1000, SubAllocator::Tlsf},
+      {500, SubAllocator::Tlsf}, // shrunk in place, not moved back to the slabs
+      {2 * LARGE_MIN, SubAllocator::Mapping},
+      {4 * LARGE_MIN, SubAllocator::Mapping}, // resized with mremap
+      {LARGE_MIN - 1, SubAllocator::Tlsf},
+      {3 * LARGE_MIN, SubAllocator::Mapping},
+      {64, SubAllocator::Slab},
+    })
+  {
+    kept_size = std::min(kept_size, step.new_size);
+    ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().realloc(ptr, step.new_size));
+    ASSERT_TRUE(ptr != nullptr);
+    EXPECT_EQ(sub_allocator_of(ptr), step.sub_allocator) << step.new_size;
+    EXPECT_GE(GlobalAllocator::get_instance().get_block_size(ptr), step.new_size);
+    for (size_t i = 0; i < kept_size; i++) {
+      ASSERT_EQ(ptr[i], static_cast<char>(i)) << step.new_size;
+    }
+    if (step.new_size > size) {
+      memset(ptr + size, 0xAA, step.new_size - size);
+    }
+    size = step.new_size;
+  }
+  GlobalAllocator::get_instance().dealloc(ptr);
+}
+
+// defined last, as the slabs of the exhausted arena stay assigned to the size class of the test
+TEST(composite_test, fallthrough_test) {
+  if (!default_sizes()) {
+    GTEST_SKIP() << "the sizes of the sub-allocators are not the defaults";
+  }
+  // small blocks go to the TLSF pool once the slab arena is exhausted, and medium blocks to
+  // mappings once the pool is exhausted
+  struct Exhaustion
+  {
+    size_t size;
+    SubAllocator sub_allocator;
+    SubAllocator next;
+  };
+  for (const Exhaustion & exhaustion : {
+      Exhaustion{SMALL_MAX, SubAllocator::Slab, SubAllocator::Tlsf},
+      Exhaustion{LARGE_MIN - 1, SubAllocator::Tlsf, SubAllocator::Mapping},
+    })
+  {
+    std::vector<void *> ptrs;
+    SubAllocator sub_allocator = exhaustion.sub_allocator;
+    while (sub_allocator == exhaustion.sub_allocator && ptrs.size() < 1000000) {
+      ptrs.push_back(GlobalAllocator::get_instance().alloc(exhaustion.size));
+      ASSERT_TRUE(ptrs.back() != nullptr);
+      sub_allocator = sub_allocator_of(ptrs.back());
+    }
+    EXPECT_EQ(sub_allocator, exhaustion.next) << exhaustion.size;
+    for (auto ptr : ptrs) {
+      GlobalAllocator::get_instance().dealloc(ptr);
+    }
+
+    // the freed blocks are reused
+    void * ptr = GlobalAllocator::get_instance().alloc(exhaustion.size);
+    ASSERT_TRUE(ptr != nullptr);
+    EXPECT_EQ(sub_allocator_of(ptr), exhaustion.sub_allocator) << exhaustion.size;
+    GlobalAllocator::get_instance().dealloc(ptr);
+  }
+}
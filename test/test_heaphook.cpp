@@ -4,6 +4,7 @@
 
 #include <cstdint>
 #include <iostream>
+#include <new>
 #include <gtest/gtest.h>
 
 #include "heaphook/utils.hpp"
@@ -21,6 +22,11 @@ using pvalloc_type = void * (*)(size_t);
 
 using malloc_usable_size_type = size_t (*)(void *);
 
+// C23, not provided by older versions of glibc
+extern "C" void free_sized(void * ptr, size_t size) __attribute__((weak));
+extern "C" void free_aligned_sized(void * ptr, size_t alignment, size_t size)
+__attribute__((weak));
+
 TEST(malloc_test, valid_size_test) {
   auto test = [](size_t size) {
       void * ptr = malloc(size);
@@ -164,6 +170,47 @@ TEST(realloc_test, zero_test) {
   EXPECT_EQ(nullptr, ptr);
 }
 
+TEST(free_sized_test, valid_args_test) {
+  if (free_sized == nullptr) {
+    GTEST_SKIP() << "free_sized is not available";
+  }
+  auto test = [](size_t size) {
+      void * ptr = malloc(size);
+      EXPECT_NE(nullptr, ptr);
+      memset(ptr, 'A', size);
+      free_sized(ptr, size);
+
+      ptr = calloc(size, 3);
+      EXPECT_NE(nullptr, ptr);
+      free_sized(ptr, size * 3);
+    };
+
+  test(0);
+  test(1);
+  test(0x20);
+  test(getpagesize());
+  test(0x100000);
+  free_sized(nullptr, 0);
+}
+
+TEST(free_aligned_sized_test, valid_args_test) {
+  if (free_aligned_sized == nullptr) {
+    GTEST_SKIP() << "free_aligned_sized is not available";
+  }
+  auto test = [](size_t alignment, size_t size) {
+      void * ptr = aligned_alloc(alignment, size);
+      EXPECT_NE(nullptr, ptr);
+      memset(ptr, 'A', size);
+      free_aligned_sized(ptr, alignment, size);
+    };
+
+  test(8, 0);
+  test(16, 1);
+  test(64, 123);
+  test(getpagesize(), getpagesize());
+  free_aligned_sized(nullptr, 8, 0);
+}
+
 TEST(posix_memalign_test, valid_args_test) {
   auto test = [](size_t alignment, size_t size) {
       void * ptr = nullptr;
@@ -380,3 +427,66 @@ TEST(pvalloc_test, invalid_size_test) {
   test(0x1000000000000);
   test(SIZE_MAX);
 }
+
+TEST(operator_new_test, valid_size_test) {
+  auto test = [](size_t size) {
+      void * ptr = ::operator new(size);
+      EXPECT_NE(nullptr, ptr);
+      EXPECT_LE(size, malloc_usable_size(ptr));
+      memset(ptr, 'A', size);
+      ::operator delete(ptr, size);
+
+      ptr = ::operator new[](size, std::nothrow);
+      EXPECT_NE(nullptr, ptr);
+      memset(ptr, 'A', size);
+      ::operator delete[](ptr);
+    };
+
+  test(0);
+  test(1);
+  test(0x20);
+  test(getpagesize());
+}
+
+TEST(operator_new_test, aligned_test) {
+  auto test = [](size_t size, size_t alignment) {
+      void * ptr = ::operator new(size, std::align_val_t(alignment));
+      size_t addr = reinterpret_cast<size_t>(ptr);
+      EXPECT_NE(nullptr, ptr);
+      EXPECT_EQ(addr % alignment, 0u);
+      memset(ptr, 'A', size);
+      ::operator delete(ptr, size, std::align_val_t(alignment));
+
+      ptr = ::operator new[](size, std::align_val_t(alignment), std::nothrow);
+      addr = reinterpret_cast<size_t>(ptr);
+      EXPECT_NE(nullptr, ptr);
+      EXPECT_EQ(addr % alignment, 0u);
+      memset(ptr, 'A', size);
+      ::operator delete[](ptr, std::align_val_t(alignment));
+    };
+
+  test(1, 1);
+  test(123, 64);
+  test(getpagesize(), getpagesize());
+}
+
+TEST(operator_new_test, invalid_size_test) {
+  EXPECT_THROW((void)::operator new(0x100000000000000ull), std::bad_alloc);
+  EXPECT_THROW(
+    (void)::operator new[](0x100000000000000ull, std::align_val_t(64)), std::bad_alloc);
+  EXPECT_EQ(nullptr, ::operator new(0x100000000000000ull, std::nothrow));
+  EXPECT_EQ(nullptr, ::operator new[](0x100000000000000ull, std::align_val_t(64), std::nothrow));
+}
+
+TEST(operator_new_test, new_handler_test) {
+  static int calls;
+  calls = 0;
+  std::set_new_handler(
+    [] {
+      if (++calls == 2) {
+        std::set_new_handler(nullptr);
+      }
+    });
+  EXPECT_THROW((void)::operator new(0x100000000000000ull), std::bad_alloc);
+  EXPECT_EQ(calls, 2);
+}
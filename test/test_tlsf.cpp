@@ -0,0 +1,994 @@
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "heaphook/heaphook.hpp"
+#include "../src/tlsf/slab.hpp"
+
+using namespace heaphook;
+
+// tests of libpreloaded_tlsf specific behavior, built into the test_preloaded_tlsf* tests
+
+extern char ** environ;
+
+// runs the tests matching filter in a new process of this test, with the memory pool configured
+// by env only, and returns its exit status and output
+static int run_child(
+  const std::string & filter, const std::vector<std::string> & env, std::string & output)
+{
+  std::vector<std::string> child_env;
+  for (char ** var = environ; *var != nullptr; var++) {
+    std::string name(*var, strcspn(*var, "="));
+    if (name.rfind("TLSF_", 0) != 0 && name.rfind("HEAPHOOK_", 0) != 0 &&
+      name.find("MEMPOOL_SIZE") == std::string::npos)
+    {
+      child_env.push_back(*var);
+    }
+  }
+  child_env.insert(child_env.end(), env.begin(), env.end());
+
+  std::string filter_arg = "--gtest_filter=" + filter;
+  char exe[PATH_MAX];
+  ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (len <= 0) {
+    return -1;
+  }
+  exe[len] = '\0';
+  std::vector<char *> argv = {exe, &filter_arg[0], nullptr};
+  std::vector<char *> envp;
+  for (auto & var : child_env) {
+    envp.push_back(&var[0]);
+  }
+  envp.push_back(nullptr);
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    close(fds[0]);
+    execve(exe, argv.data(), envp.data());
+    _exit(127);
+  }
+  close(fds[1]);
+  output.clear();
+  char buf[256];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+    output.append(buf, n);
+  }
+  close(fds[0]);
+  int status;
+  if (pid == -1 || waitpid(pid, &status, 0) != pid) {
+    return -1;
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// returns the number of resident pages in [addr, addr + size)
+static size_t count_resident_pages(void * addr, size_t size)
+{
+  size_t page_size = getpagesize();
+  uintptr_t begin = reinterpret_cast<uintptr_t>(addr) / page_size * page_size;
+  uintptr_t end = reinterpret_cast<uintptr_t>(addr) + size;
+  size_t num_pages = (end - begin + page_size - 1) / page_size;
+  std::vector<unsigned char> residency(num_pages);
+  if (mincore(reinterpret_cast<void *>(begin), num_pages * page_size, residency.data()) != 0) {
+    return 0;
+  }
+  size_t count = 0;
+  for (auto page : residency) {
+    count += page & 1;
+  }
+  return count;
+}
+
+TEST(tlsf_aligned_test, tag_layout_test) {
+  for (size_t alignment : {32, 64, 256, 4096}) {
+    for (size_t size : {1, 100, 5000}) {
+      auto ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(size, alignment));
+      ASSERT_TRUE(ptr != nullptr);
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % alignment, 0u);
+
+      // every aligned block is tagged with its alignment and its offset from the TLSF block
+      size_t tag = reinterpret_cast<size_t *>(ptr)[-1];
+      EXPECT_EQ(tag & 0b1, 1u);
+      size_t offset = tag & ~0b1111ull;
+      EXPECT_GE(offset, 2 * sizeof(void *));
+      EXPECT_LE(offset, alignment);
+      EXPECT_EQ(reinterpret_cast<size_t *>(ptr)[-2], alignment);
+      GlobalAllocator::get_instance().dealloc(ptr);
+    }
+  }
+}
+
+TEST(tlsf_aligned_test, usable_size_test) {
+  const size_t ALIGNMENT = 256;
+  for (size_t size : {1, 100, 5000}) {
+    auto first = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(size, ALIGNMENT));
+    auto second = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(size, ALIGNMENT));
+    ASSERT_TRUE(first != nullptr && second != nullptr);
+    memset(second, 'B', size);
+
+    // the usable size is counted from the aligned pointer, and all of it can be written
+    size_t usable_size = GlobalAllocator::get_instance().get_block_size(first);
+    EXPECT_GE(usable_size, size);
+    EXPECT_LT(usable_size, size + ALIGNMENT + 64);
+    memset(first, 'A', usable_size);
+    for (size_t i = 0; i < size; i++) {
+      ASSERT_EQ(second[i], 'B');
+    }
+    GlobalAllocator::get_instance().dealloc(first);
+    GlobalAllocator::get_instance().dealloc(second);
+  }
+}
+
+TEST(tlsf_aligned_test, overflow_test) {
+  for (size_t alignment : {32, 64, 4096}) {
+    EXPECT_EQ(GlobalAllocator::get_instance().alloc(SIZE_MAX - 10, alignment), nullptr);
+    EXPECT_EQ(GlobalAllocator::get_instance().alloc(SIZE_MAX - alignment + 1, alignment), nullptr);
+  }
+}
+
+TEST(tlsf_aligned_test, realloc_keeps_alignment_test) {
+  for (size_t alignment : {32, 256, 4096}) {
+    const size_t SIZE = 100;
+    auto ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(SIZE, alignment));
+    ASSERT_TRUE(ptr != nullptr);
+    for (size_t i = 0; i < SIZE; i++) {
+      ptr[i] = static_cast<char>(i);
+    }
+
+    // grown, shrunk and grown again, the block stays aligned and keeps its contents
+    for (size_t new_size : {10000, 50, 300000}) {
+      size_t kept_size = std::min<size_t>(SIZE, new_size);
+      ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().realloc(ptr, new_size));
+      ASSERT_TRUE(ptr != nullptr);
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % alignment, 0u);
+      EXPECT_GE(GlobalAllocator::get_instance().get_block_size(ptr), new_size);
+      for (size_t i = 0; i < std::min<size_t>(kept_size, 50); i++) {
+        ASSERT_EQ(ptr[i], static_cast<char>(i));
+      }
+    }
+    GlobalAllocator::get_instance().dealloc(ptr);
+  }
+}
+
+// returns whether the size bytes at ptr are all zero
+static bool is_zero(void * ptr, size_t size)
+{
+  auto bytes = reinterpret_cast<unsigned char *>(ptr);
+  for (size_t i = 0; i < size; i++) {
+    if (bytes[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TEST(tlsf_aligned_test, realloc_shrinks_large_block_test) {
+  const size_t SIZE = 8000000; // over TLSF_MMAP_THRESHOLD of run_tlsf_mmap
+  for (size_t alignment : {1, 4096}) {
+    auto ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(SIZE, alignment));
+    ASSERT_TRUE(ptr != nullptr);
+    for (size_t i = 0; i < SIZE; i++) {
+      ptr[i] = static_cast<char>(i % 251);
+    }
+
+    // shrunk over and under the threshold, and grown from the pool into a mapping again
+    size_t kept_size = SIZE;
+    for (size_t new_size : {2000000, 100000, 3000000}) {
+      kept_size = std::min(kept_size, new_size);
+      ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().realloc(ptr, new_size));
+      ASSERT_TRUE(ptr != nullptr);
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % alignment, 0u);
+      for (size_t i = 0; i < kept_size; i++) {
+        ASSERT_EQ(ptr[i], static_cast<char>(i % 251)) << alignment << ", " << new_size;
+      }
+      memset(ptr + kept_size, 0xAA, new_size - kept_size);
+    }
+    GlobalAllocator::get_instance().dealloc(ptr);
+  }
+}
+
+TEST(tlsf_calloc_test, reused_block_test) {
+  const size_t SIZE = 3000; // larger than the slabs
+  size_t num_reused = 0;
+  for (int i = 0; i < 16; i++) {
+    void * freed = GlobalAllocator::get_instance().alloc(SIZE);
+    void * guard = GlobalAllocator::get_instance().alloc(SIZE); // keeps it off the free space
+    ASSERT_TRUE(freed != nullptr && guard != nullptr);
+    memset(freed, 0xAA, SIZE);
+    GlobalAllocator::get_instance().dealloc(freed);
+
+    void * ptr = GlobalAllocator::get_instance().alloc_zeroed(SIZE);
+    ASSERT_TRUE(ptr != nullptr);
+    EXPECT_TRUE(is_zero(ptr, SIZE));
+    num_reused += ptr == freed;
+    memset(ptr, 0xAA, SIZE);
+    GlobalAllocator::get_instance().dealloc(ptr);
+    GlobalAllocator::get_instance().dealloc(guard);
+  }
+  EXPECT_GT(num_reused, 0u);
+}
+
+TEST(tlsf_calloc_test, coalesced_block_test) {
+  const size_t SIZE = 3000;
+  for (int i = 0; i < 16; i++) {
+    void * first = GlobalAllocator::get_instance().alloc(SIZE);
+    void * second = GlobalAllocator::get_instance().alloc(SIZE);
+    void * guard = GlobalAllocator::get_instance().alloc(SIZE); // keeps them off the free space
+    ASSERT_TRUE(first != nullptr && second != nullptr && guard != nullptr);
+    memset(first, 0xAA, SIZE);
+    memset(second, 0xAA, SIZE);
+    GlobalAllocator::get_instance().dealloc(first);
+    GlobalAllocator::get_instance().dealloc(second);
+
+    // the block headers between the freed blocks are dirty as well
+    void * ptr = GlobalAllocator::get_instance().alloc_zeroed(2 * SIZE);
+    ASSERT_TRUE(ptr != nullptr);
+    EXPECT_TRUE(is_zero(ptr, 2 * SIZE));
+    memset(ptr, 0xAA, 2 * SIZE);
+    GlobalAllocator::get_instance().dealloc(ptr);
+    GlobalAllocator::get_instance().dealloc(guard);
+  }
+}
+
+TEST(tlsf_calloc_test, remote_freed_block_test) {
+  const size_t SIZE = 3000;
+  const size_t COUNT = 64;
+  std::vector<void *> ptrs;
+  std::atomic<bool> allocated{false};
+  std::atomic<bool> freed{false};
+  std::thread thread([&]() {
+      for (size_t i = 0; i < COUNT; i++) {
+        ptrs.push_back(GlobalAllocator::get_instance().alloc(SIZE));
+        ASSERT_TRUE(ptrs.back() != nullptr);
+        memset(ptrs.back(), 0xAA, SIZE);
+      }
+      allocated.store(true);
+      while (!freed.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+
+      // the blocks freed by the other thread are linked through their first word
+      for (size_t i = 0; i < COUNT; i++) {
+        void * ptr = GlobalAllocator::get_instance().alloc_zeroed(SIZE);
+        ASSERT_TRUE(ptr != nullptr);
+        EXPECT_TRUE(is_zero(ptr, SIZE));
+        ptrs[i] = ptr;
+      }
+    });
+  while (!allocated.load()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  for (auto ptr : ptrs) {
+    GlobalAllocator::get_instance().dealloc(ptr);
+  }
+  freed.store(true);
+  thread.join();
+  for (auto ptr : ptrs) {
+    GlobalAllocator::get_instance().dealloc(ptr);
+  }
+}
+
+TEST(tlsf_calloc_test, extended_area_test) {
+  std::string output;
+  EXPECT_EQ(
+    run_child(
+      "tlsf_calloc_test.extended_area_child_test",
+      {"INITIAL_MEMPOOL_SIZE=16000000", "ADDITIONAL_MEMPOOL_SIZE=4000000",
+        "TLSF_CALLOC_TEST=1"}, output), 0) << output;
+}
+
+// run by extended_area_test
+TEST(tlsf_calloc_test, extended_area_child_test) {
+  if (std::getenv("TLSF_CALLOC_TEST") == nullptr) {
+    GTEST_SKIP() << "run by extended_area_test";
+  }
+  const size_t SIZE = 8000000;
+  const size_t LARGE_SIZE = 40000000;
+  auto ptr = GlobalAllocator::get_instance().alloc(SIZE);
+  ASSERT_TRUE(ptr != nullptr);
+  memset(ptr, 0xAA, SIZE);
+  GlobalAllocator::get_instance().dealloc(ptr);
+
+  // the added area is known to be zero, and it is dirty when it is handed out again
+  AllocatorStats before;
+  ASSERT_TRUE(GlobalAllocator::get_instance().get_stats(before, false));
+  for (int i = 0; i < 2; i++) {
+    ptr = GlobalAllocator::get_instance().alloc_zeroed(LARGE_SIZE);
+    ASSERT_TRUE(ptr != nullptr);
+    EXPECT_TRUE(is_zero(ptr, LARGE_SIZE));
+    memset(ptr, 0xAA, LARGE_SIZE);
+    GlobalAllocator::get_instance().dealloc(ptr);
+  }
+  AllocatorStats after;
+  ASSERT_TRUE(GlobalAllocator::get_instance().get_stats(after, false));
+  EXPECT_EQ(after.num_added_areas, before.num_added_areas + 1);
+}
+
+TEST(tlsf_prefault_test, residency_test) {
+  for (const char * policy : {"lazy", "sync", "populate", "mlock"}) {
+    std::string output;
+    EXPECT_EQ(
+      run_child(
+        "tlsf_prefault_test.child_test",
+        {std::string("TLSF_PREFAULT=") + policy, "INITIAL_MEMPOOL_SIZE=64000000",
+          "TLSF_PREFAULT_TEST=1"}, output), 0) << policy << ":\n" << output;
+  }
+}
+
+// run by residency_test for each policy
+TEST(tlsf_prefault_test, child_test) {
+  const char * policy = std::getenv("TLSF_PREFAULT");
+  if (std::getenv("TLSF_PREFAULT_TEST") == nullptr || policy == nullptr) {
+    GTEST_SKIP() << "run by residency_test";
+  }
+  const size_t POOL_SIZE = 64000000;
+  const size_t ALLOCATION_SIZE = 16 * 1024 * 1024;
+  if (strcmp(policy, "mlock") == 0) {
+    struct rlimit limit;
+    if (geteuid() != 0 && getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur < POOL_SIZE) {
+      GTEST_SKIP() << "RLIMIT_MEMLOCK is too small";
+    }
+  }
+
+  // nothing has touched the pages of a large block from the new pool
+  void * ptr = GlobalAllocator::get_instance().alloc(ALLOCATION_SIZE);
+  ASSERT_TRUE(ptr != nullptr);
+  size_t num_pages = ALLOCATION_SIZE / getpagesize();
+  size_t resident = count_resident_pages(ptr, ALLOCATION_SIZE);
+  if (strcmp(policy, "lazy") == 0) {
+    EXPECT_LT(resident, num_pages / 2);
+  } else if (strcmp(policy, "populate") == 0) {
+    // populated in the background
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (resident < num_pages && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      resident = count_resident_pages(ptr, ALLOCATION_SIZE);
+    }
+    EXPECT_GE(resident, num_pages);
+  } else {
+    EXPECT_GE(resident, num_pages);
+  }
+  GlobalAllocator::get_instance().dealloc(ptr);
+}
+
+TEST(tlsf_hugepage_test, transparent_test) {
+  // transparent huge pages are only reported when their mode lets madvise request them
+  size_t expected_page_size = getpagesize();
+  char mode[128] = {};
+  if (FILE * fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r")) {
+    if (fgets(mode, sizeof(mode), fp) != nullptr &&
+      (strstr(mode, "[always]") != nullptr || strstr(mode, "[madvise]") != nullptr))
+    {
+      expected_page_size = 2 * 1024 * 1024;
+    }
+    fclose(fp);
+  }
+
+  std::string output;
+  ASSERT_EQ(
+    run_child(
+      "tlsf_aligned_test.tag_layout_test",
+      {"TLSF_HUGEPAGE=thp", "TLSF_VERBOSE=1", "INITIAL_MEMPOOL_SIZE=16000000"}, output), 0) <<
+    output;
+  std::string pages = "bytes of " + std::to_string(expected_page_size) + "-byte pages";
+  EXPECT_NE(output.find(pages), std::string::npos) << mode << output;
+}
+
+// returns whether the maintenance thread of the memory pool runs in this process
+static bool has_maintenance_thread()
+{
+  DIR * dir = opendir("/proc/self/task");
+  if (dir == nullptr) {
+    return false;
+  }
+  bool found = false;
+  while (struct dirent * entry = readdir(dir)) {
+    std::string path = std::string("/proc/self/task/") + entry->d_name + "/comm";
+    char comm[32] = {};
+    if (FILE * fp = fopen(path.c_str(), "r")) {
+      found |= fgets(comm, sizeof(comm), fp) != nullptr && strcmp(comm, "heaphook_tlsf\n") == 0;
+      fclose(fp);
+    }
+  }
+  closedir(dir);
+  return found;
+}
+
+TEST(tlsf_maintenance_test, fork_test) {
+  ASSERT_TRUE(GlobalAllocator::get_instance().alloc(100000) != nullptr);
+  ASSERT_TRUE(has_maintenance_thread());
+
+  // another thread keeps the heaps busy while the process forks
+  std::atomic<bool> done{false};
+  std::thread allocating_thread([&done]() {
+      while (!done.load()) {
+        void * ptr = GlobalAllocator::get_instance().alloc(100000);
+        GlobalAllocator::get_instance().dealloc(ptr);
+      }
+    });
+
+  for (int i = 0; i < 10; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      // the child allocates, and gets a maintenance thread of its own
+      void * ptr = GlobalAllocator::get_instance().alloc(100000);
+      bool allocated = ptr != nullptr;
+      GlobalAllocator::get_instance().dealloc(ptr);
+      bool restarted = has_maintenance_thread();
+      for (int j = 0; j < 500 && !restarted; j++) {
+        usleep(10 * 1000);
+        restarted = has_maintenance_thread();
+      }
+      _exit(allocated && restarted ? 0 : 1);
+    }
+    ASSERT_NE(pid, -1);
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+
+  done.store(true);
+  allocating_thread.join();
+  EXPECT_TRUE(has_maintenance_thread());
+}
+
+TEST(tlsf_maintenance_test, watermark_test) {
+  std::string output;
+  EXPECT_EQ(
+    run_child(
+      "tlsf_maintenance_test.watermark_child_test",
+      {"INITIAL_MEMPOOL_SIZE=16000000", "ADDITIONAL_MEMPOOL_SIZE=8000000",
+        "TLSF_LOW_WATERMARK=8000000", "TLSF_VERBOSE=1", "TLSF_MAINTENANCE_TEST=1"}, output), 0) <<
+    output;
+  EXPECT_NE(output.find("bytes added in the background"), std::string::npos) << output;
+  EXPECT_EQ(output.find("TLSF memory pool exhausted"), std::string::npos) << output;
+}
+
+// run by watermark_test
+TEST(tlsf_maintenance_test, watermark_child_test) {
+  if (std::getenv("TLSF_MAINTENANCE_TEST") == nullptr) {
+    GTEST_SKIP() << "run by watermark_test";
+  }
+  AllocatorStats before;
+  ASSERT_TRUE(GlobalAllocator::get_instance().get_stats(before, false));
+
+  // less than 8MB of the 16MB pool stays free, but no allocation exhausts it
+  std::vector<void *> ptrs;
+  for (int i = 0; i < 10; i++) {
+    ptrs.push_back(GlobalAllocator::get_instance().alloc(1000000));
+    ASSERT_TRUE(ptrs.back() != nullptr);
+  }
+
+  // the maintenance thread adds an area of at least the watermark
+  AllocatorStats after;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  do {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_TRUE(GlobalAllocator::get_instance().get_stats(after, false));
+  } while (after.num_added_areas == before.num_added_areas &&
+  std::chrono::steady_clock::now() < deadline);
+  EXPECT_EQ(after.num_added_areas, before.num_added_areas + 1);
+  EXPECT_GE(after.added_area_bytes - before.added_area_bytes, 8000000u);
+
+  for (auto ptr : ptrs) {
+    GlobalAllocator::get_instance().dealloc(ptr);
+  }
+}
+
+TEST(tlsf_maintenance_test, oversize_test) {
+  std::string output;
+  EXPECT_EQ(
+    run_child(
+      "tlsf_maintenance_test.oversize_child_test",
+      {"INITIAL_MEMPOOL_SIZE=16000000", "ADDITIONAL_MEMPOOL_SIZE=4000000",
+        "TLSF_MAINTENANCE_TEST=1"}, output), 0) << output;
+}
+
+// run by oversize_test
+TEST(tlsf_maintenance_test, oversize_child_test) {
+  if (std::getenv("TLSF_MAINTENANCE_TEST") == nullptr) {
+    GTEST_SKIP() << "run by oversize_test";
+  }
+  const size_t ALLOCATION_SIZE = 40000000;
+  AllocatorStats before;
+  ASSERT_TRUE(GlobalAllocator::get_instance().get_stats(before, false));
+
+  // a request over ADDITIONAL_MEMPOOL_SIZE gets one area large enough for it
+  auto ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(ALLOCATION_SIZE));
+  ASSERT_TRUE(ptr != nullptr);
+  memset(ptr, 'A', ALLOCATION_SIZE);
+  AllocatorStats after;
+  ASSERT_TRUE(GlobalAllocator::get_instance().get_stats(after, false));
+  EXPECT_EQ(after.num_added_areas, before.num_added_areas + 1);
+  EXPECT_GE(after.added_area_bytes - before.added_area_bytes, ALLOCATION_SIZE);
+  GlobalAllocator::get_instance().dealloc(ptr);
+}
+
+TEST(tlsf_remote_free_test, owner_test) {
+  std::string output;
+  EXPECT_EQ(
+    run_child(
+      "tlsf_remote_free_test.owner_child_test",
+      {"TLSF_THREAD_POOLS=tlsf_owner=40000000", "TLSF_RELEASE_THRESHOLD=1000000",
+        "TLSF_REMOTE_FREE_TEST=1"}, output), 0) << output;
+}
+
+enum class OwnerPhase { Allocates, Exits, Exited };
+
+// frees blocks of a dedicated heap from another thread, and waits for the maintenance thread to
+// release their pages, which it only does once the frees have been drained into the heap
+static void free_remotely(OwnerPhase phase)
+{
+  const size_t BLOCK_SIZE = 1000000;
+  const size_t BLOCK_COUNT = 16;
+  std::vector<char *> blocks;
+  std::atomic<bool> freed{false};
+  std::atomic<bool> done{false};
+  std::thread owner([&]() {
+      pthread_setname_np(pthread_self(), "tlsf_owner");
+      for (size_t i = 0; i < BLOCK_COUNT; i++) {
+        auto block = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(BLOCK_SIZE));
+        ASSERT_TRUE(block != nullptr);
+        memset(block, 'A', BLOCK_SIZE);
+        blocks.push_back(block);
+      }
+      if (phase == OwnerPhase::Exited) {
+        return;
+      }
+      while (!freed.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      if (phase == OwnerPhase::Allocates) {
+        GlobalAllocator::get_instance().dealloc(GlobalAllocator::get_instance().alloc(64));
+        while (!done.load()) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+      }
+    });
+  while (phase != OwnerPhase::Exited && blocks.size() < BLOCK_COUNT) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (phase == OwnerPhase::Exited) {
+    owner.join();
+  }
+  ASSERT_EQ(blocks.size(), BLOCK_COUNT);
+
+  // the first and the last page of a block keep the headers of the free blocks
+  size_t page_size = getpagesize();
+  auto count_interior_pages = [&]() {
+      size_t count = 0;
+      for (auto block : blocks) {
+        count += count_resident_pages(block + page_size, BLOCK_SIZE - 2 * page_size);
+      }
+      return count;
+    };
+  size_t before = count_interior_pages();
+  EXPECT_GT(before, 0u);
+  for (auto block : blocks) {
+    GlobalAllocator::get_instance().dealloc(block);
+  }
+  freed.store(true);
+  if (phase == OwnerPhase::Exits) {
+    owner.join();
+  }
+
+  size_t after;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  do {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    after = count_interior_pages();
+  } while (after * 16 > before && std::chrono::steady_clock::now() < deadline);
+  EXPECT_LE(after * 16, before);
+
+  done.store(true);
+  if (phase == OwnerPhase::Allocates) {
+    owner.join();
+  }
+}
+
+// run by owner_test
+TEST(tlsf_remote_free_test, owner_child_test) {
+  if (std::getenv("TLSF_REMOTE_FREE_TEST") == nullptr) {
+    GTEST_SKIP() << "run by owner_test";
+  }
+  // the owner drains the frees on its next allocation
+  free_remotely(OwnerPhase::Allocates);
+  // the owner drains the frees when it exits
+  free_remotely(OwnerPhase::Exits);
+  // the freeing thread frees the blocks itself, as the heap has no thread left
+  free_remotely(OwnerPhase::Exited);
+}
+
+TEST(tlsf_callsite_test, learning_test) {
+  std::string output;
+  EXPECT_EQ(
+    run_child(
+      "tlsf_callsite_test.learning_child_test",
+      {"INITIAL_MEMPOOL_SIZE=16000000", "TLSF_CALLSITE_POOL_SIZE=8000000",
+        "TLSF_ON_EXHAUSTION=enomem", "TLSF_VERBOSE=1", "TLSF_CALLSITE_TEST=1"}, output), 0) <<
+    output;
+  // the learned call site is listed at exit
+  size_t pos = output.find("segregated call sites:\n");
+  ASSERT_NE(pos, std::string::npos) << output;
+  EXPECT_NE(output.find("+0x", pos), std::string::npos) << output;
+}
+
+// two call sites of malloc, the return addresses of which tell them apart
+__attribute__((noinline)) static void * short_lived_malloc(size_t size)
+{
+  void * ptr = malloc(size);
+  asm volatile ("" : : : "memory"); // not a tail call
+  return ptr;
+}
+
+__attribute__((noinline)) static void * long_lived_malloc(size_t size)
+{
+  void * ptr = malloc(size);
+  if (ptr != nullptr) {
+    memset(ptr, 0, 1); // unlike short_lived_malloc, so that the two are not folded into one
+  }
+  return ptr;
+}
+
+// run by learning_test
+TEST(tlsf_callsite_test, learning_child_test) {
+  if (std::getenv("TLSF_CALLSITE_TEST") == nullptr) {
+    GTEST_SKIP() << "run by learning_test";
+  }
+  const size_t SIZE = 100000;
+
+  // the blocks of the call site are freed right away, so it is segregated
+  for (int i = 0; i < 4096; i++) {
+    free(short_lived_malloc(SIZE));
+  }
+
+  // the other call site exhausts the pool the thread allocates from
+  std::vector<void *> long_lived;
+  for (size_t size : {SIZE, size_t{1000}}) {
+    while (void * ptr = long_lived_malloc(size)) {
+      long_lived.push_back(ptr);
+    }
+  }
+  void * exhausted = long_lived_malloc(SIZE);
+  void * segregated = short_lived_malloc(SIZE);
+  for (auto ptr : long_lived) {
+    free(ptr);
+  }
+  free(segregated);
+  free(exhausted);
+  EXPECT_EQ(exhausted, nullptr);
+  EXPECT_NE(segregated, nullptr);
+
+  // blocks of both heaps freed by another thread, twice the separate heap over
+  for (int round = 0; round < 2; round++) {
+    std::vector<void *> ptrs;
+    for (int i = 0; i < 64; i++) {
+      ptrs.push_back(short_lived_malloc(SIZE));
+      ptrs.push_back(long_lived_malloc(SIZE));
+    }
+    for (auto ptr : ptrs) {
+      ASSERT_NE(ptr, nullptr) << "round " << round;
+    }
+    std::thread thread([&ptrs]() {
+        for (auto ptr : ptrs) {
+          free(ptr);
+        }
+      });
+    thread.join();
+  }
+}
+
+TEST(tlsf_thread_pools_test, rename_test) {
+  std::string output;
+  EXPECT_EQ(
+    run_child(
+      "tlsf_thread_pools_test.rename_child_test",
+      {"TLSF_THREAD_POOLS=tlsf_renamed=8000000,tlsf_bystander=8000000", "TLSF_VERBOSE=1",
+        "TLSF_RENAME_TEST=1"}, output), 0) << output;
+
+  // only the renamed thread looks its heap up again
+  auto count = [&output](const std::string & line) {
+      size_t num_lines = 0;
+      for (size_t pos = output.find(line); pos != std::string::npos;
+        pos = output.find(line, pos + 1))
+      {
+        num_lines++;
+      }
+      return num_lines;
+    };
+  EXPECT_EQ(count("thread tlsf_bystander ("), 1u) << output;
+  EXPECT_EQ(count("thread tlsf_renamed ("), 1u) << output;
+  EXPECT_EQ(count("uses the pool of tlsf_renamed."), 1u) << output;
+}
+
+// run by rename_test
+TEST(tlsf_thread_pools_test, rename_child_test) {
+  if (std::getenv("TLSF_RENAME_TEST") == nullptr) {
+    GTEST_SKIP() << "run by rename_test";
+  }
+  std::atomic<int> num_ready{0};
+  std::atomic<bool> renamed{false};
+  auto allocate = []() {
+      void * ptr = GlobalAllocator::get_instance().alloc(1000);
+      EXPECT_TRUE(ptr != nullptr);
+      GlobalAllocator::get_instance().dealloc(ptr);
+    };
+  auto wait_for_rename = [&renamed]() {
+      while (!renamed.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    };
+
+  std::thread bystander([&]() {
+      pthread_setname_np(pthread_self(), "tlsf_bystander");
+      allocate();
+      num_ready++;
+      wait_for_rename();
+      allocate();
+    });
+  std::thread target([&]() {
+      allocate();
+      num_ready++;
+      wait_for_rename();
+      allocate(); // from the pool of its new name
+      // renamed by itself, back to the thread heaps
+      pthread_setname_np(pthread_self(), "tlsf_other");
+      allocate();
+    });
+  while (num_ready.load() < 2) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(pthread_setname_np(target.native_handle(), "tlsf_renamed"), 0);
+  renamed.store(true);
+  target.join();
+  bystander.join();
+}
+
+TEST(tlsf_slab_test, reuse_test) {
+  SlabAllocator & slab_allocator = SlabAllocator::getInstance();
+  if (!slab_allocator.enabled()) {
+    GTEST_SKIP() << "TLSF_SLAB_ARENA_SIZE is not set";
+  }
+
+  // a freed object is reused by the next allocation of its size class
+  void * ptr = GlobalAllocator::get_instance().alloc(100);
+  ASSERT_TRUE(slab_allocator.contains(ptr));
+  EXPECT_EQ(GlobalAllocator::get_instance().get_block_size(ptr), 112u);
+  GlobalAllocator::get_instance().dealloc(ptr);
+  for (size_t size : {97, 100, 112}) {
+    void * reused = GlobalAllocator::get_instance().alloc(size);
+    EXPECT_EQ(reused, ptr) << size;
+    GlobalAllocator::get_instance().dealloc(reused);
+  }
+
+  // but not by another size class
+  void * other = GlobalAllocator::get_instance().alloc(113);
+  EXPECT_TRUE(slab_allocator.contains(other));
+  EXPECT_NE(other, ptr);
+  EXPECT_EQ(GlobalAllocator::get_instance().get_block_size(other), 128u);
+  GlobalAllocator::get_instance().dealloc(other);
+}
+
+TEST(tlsf_slab_test, thread_exit_flush_test) {
+  SlabAllocator & slab_allocator = SlabAllocator::getInstance();
+  if (!slab_allocator.enabled()) {
+    GTEST_SKIP() << "TLSF_SLAB_ARENA_SIZE is not set";
+  }
+  const size_t OBJECT_SIZE = 240;
+  const size_t OBJECT_COUNT = 20; // fewer than a magazine holds, so none is flushed before exit
+
+  std::set<void *> freed;
+  std::thread thread([&freed]() {
+      std::vector<void *> ptrs;
+      for (size_t i = 0; i < OBJECT_COUNT; i++) {
+        ptrs.push_back(GlobalAllocator::get_instance().alloc(OBJECT_SIZE));
+      }
+      for (auto ptr : ptrs) {
+        freed.insert(ptr);
+        GlobalAllocator::get_instance().dealloc(ptr);
+      }
+    });
+  thread.join();
+
+  // the objects left in the magazine of the exited thread are returned to the size class, and
+  // this thread gets them after what its own magazine holds
+  std::vector<void *> ptrs;
+  size_t num_reused = 0;
+  for (size_t i = 0; i < 64 + OBJECT_COUNT; i++) {
+    void * ptr = GlobalAllocator::get_instance().alloc(OBJECT_SIZE);
+    ASSERT_TRUE(slab_allocator.contains(ptr));
+    num_reused += freed.count(ptr);
+    ptrs.push_back(ptr);
+  }
+  EXPECT_EQ(num_reused, OBJECT_COUNT);
+  for (auto ptr : ptrs) {
+    GlobalAllocator::get_instance().dealloc(ptr);
+  }
+}
+
+TEST(tlsf_slab_test, realloc_test) {
+  SlabAllocator & slab_allocator = SlabAllocator::getInstance();
+  if (!slab_allocator.enabled()) {
+    GTEST_SKIP() << "TLSF_SLAB_ARENA_SIZE is not set";
+  }
+
+  auto ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(100));
+  ASSERT_TRUE(slab_allocator.contains(ptr));
+  for (int i = 0; i < 100; i++) {
+    ptr[i] = static_cast<char>(i);
+  }
+
+  // shrinking keeps the object, and growing out of the size classes moves it to TLSF
+  EXPECT_EQ(GlobalAllocator::get_instance().realloc(ptr, 50), ptr);
+  EXPECT_EQ(GlobalAllocator::get_instance().realloc(ptr, 112), ptr);
+  ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().realloc(ptr, 1000));
+  ASSERT_TRUE(ptr != nullptr);
+  EXPECT_FALSE(slab_allocator.contains(ptr));
+  EXPECT_GE(GlobalAllocator::get_instance().get_block_size(ptr), 1000u);
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(ptr[i], static_cast<char>(i));
+  }
+
+  // a TLSF block shrunk to a small size stays in TLSF
+  ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().realloc(ptr, 16));
+  ASSERT_TRUE(ptr != nullptr);
+  EXPECT_FALSE(slab_allocator.contains(ptr));
+  for (int i = 0; i < 16; i++) {
+    ASSERT_EQ(ptr[i], static_cast<char>(i));
+  }
+  GlobalAllocator::get_instance().dealloc(ptr);
+}
+
+TEST(tlsf_slab_test, exhausted_arena_test) {
+  std::string output;
+  EXPECT_EQ(
+    run_child(
+      "tlsf_slab_test.exhausted_arena_child_test",
+      {"TLSF_SLAB_ARENA_SIZE=1048576", "TLSF_SLAB_TEST=1"}, output), 0) << output;
+}
+
+// run by exhausted_arena_test
+TEST(tlsf_slab_test, exhausted_arena_child_test) {
+  if (std::getenv("TLSF_SLAB_TEST") == nullptr) {
+    GTEST_SKIP() << "run by exhausted_arena_test";
+  }
+  SlabAllocator & slab_allocator = SlabAllocator::getInstance();
+  ASSERT_TRUE(slab_allocator.enabled());
+
+  // the 16 slabs of the arena hold fewer 64-byte objects than this, and the others come from TLSF
+  const size_t OBJECT_COUNT = 16 * SlabAllocator::kSlabSize / 64;
+  std::vector<char *> ptrs;
+  size_t num_slab_objects = 0;
+  for (size_t i = 0; i < OBJECT_COUNT; i++) {
+    auto ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(64));
+    ASSERT_TRUE(ptr != nullptr);
+    memset(ptr, static_cast<int>(i & 0xff), 64);
+    num_slab_objects += slab_allocator.contains(ptr);
+    ptrs.push_back(ptr);
+  }
+  EXPECT_GT(num_slab_objects, 0u);
+  EXPECT_LT(num_slab_objects, OBJECT_COUNT);
+  EXPECT_FALSE(slab_allocator.contains(ptrs.back()));
+
+  for (size_t i = 0; i < OBJECT_COUNT; i++) {
+    ASSERT_EQ(ptrs[i][63], static_cast<char>(i & 0xff));
+    GlobalAllocator::get_instance().dealloc(ptrs[i]);
+  }
+}
+
+// returns the contents of the only profile in dir, or "" if there is none
+static std::string read_profile(const std::string & dir)
+{
+  std::string contents;
+  if (DIR * d = opendir(dir.c_str())) {
+    while (struct dirent * entry = readdir(d)) {
+      std::string name = entry->d_name;
+      if (name.size() > 5 && name.compare(name.size() - 5, 5, ".tlsf") == 0) {
+        std::ifstream file(dir + "/" + name);
+        std::stringstream stream;
+        stream << file.rdbuf();
+        contents = stream.str();
+      }
+    }
+    closedir(d);
+  }
+  return contents;
+}
+
+// overwrites the only profile in dir with contents
+static void write_profile(const std::string & dir, const std::string & contents)
+{
+  if (DIR * d = opendir(dir.c_str())) {
+    while (struct dirent * entry = readdir(d)) {
+      std::string name = entry->d_name;
+      if (name.size() > 5 && name.compare(name.size() - 5, 5, ".tlsf") == 0) {
+        std::ofstream(dir + "/" + name) << contents;
+      }
+    }
+    closedir(d);
+  }
+}
+
+TEST(tlsf_profile_test, learning_test) {
+  std::string dir = testing::TempDir() + "tlsf_profile_XXXXXX";
+  ASSERT_TRUE(mkdtemp(&dir[0]) != nullptr);
+  const std::vector<std::string> env = {
+    "TLSF_PROFILE_DIR=" + dir, "TLSF_VERBOSE=1", "TLSF_PROFILE_TEST=1"};
+  const std::string filter = "tlsf_profile_test.child_test";
+  std::string output;
+
+  // the first run records what it needed, and the next one starts with it
+  ASSERT_EQ(run_child(filter, env, output), 0) << output;
+  EXPECT_NE(output.find("recorded in " + dir), std::string::npos) << output;
+  std::string profile = read_profile(dir);
+  EXPECT_EQ(profile.rfind("runs 1\n", 0), 0u) << profile;
+  size_t pool_bytes = std::stoull(profile.substr(profile.find("pool_bytes ") + 11));
+  EXPECT_GE(pool_bytes, 8u * 1024 * 1024);
+
+  ASSERT_EQ(run_child(filter, env, output), 0) << output;
+  EXPECT_NE(
+    output.find(
+      std::to_string(pool_bytes + pool_bytes / 100 * 25) + " bytes from the profile of 1 runs"),
+    std::string::npos) << output;
+  EXPECT_EQ(read_profile(dir).rfind("runs 2\n", 0), 0u);
+
+  // a small profile is clamped to the minimum pool size
+  write_profile(dir, "runs 5\npool_bytes 1000\nlast_bytes 1000\nlast_areas 0\n");
+  ASSERT_EQ(run_child(filter, env, output), 0) << output;
+  EXPECT_NE(output.find("1048576 bytes from the profile of 5 runs"), std::string::npos) << output;
+  EXPECT_EQ(read_profile(dir).rfind("runs 6\n", 0), 0u);
+
+  // corrupt profiles are ignored, and learned again
+  for (const char * corrupt : {"pool_bytes 99999999999999999999\n", "\x01\x02 garbage"}) {
+    write_profile(dir, corrupt);
+    ASSERT_EQ(run_child(filter, env, output), 0) << output;
+    EXPECT_EQ(output.find("bytes from the profile"), std::string::npos) << output;
+    EXPECT_EQ(read_profile(dir).rfind("runs 1\n", 0), 0u) << corrupt;
+  }
+
+  // a profile which cannot be written is reported
+  ASSERT_EQ(
+    run_child(
+      filter, {"TLSF_PROFILE_DIR=" + dir + "/missing", "TLSF_PROFILE_TEST=1"}, output), 0) <<
+    output;
+  EXPECT_NE(output.find("failed to write the profile"), std::string::npos) << output;
+
+  std::string command = "rm -rf " + dir;
+  EXPECT_EQ(system(command.c_str()), 0);
+}
+
+// run by learning_test
+TEST(tlsf_profile_test, child_test) {
+  if (std::getenv("TLSF_PROFILE_TEST") == nullptr) {
+    GTEST_SKIP() << "run by learning_test";
+  }
+  auto ptr = reinterpret_cast<char *>(GlobalAllocator::get_instance().alloc(8 * 1024 * 1024));
+  ASSERT_TRUE(ptr != nullptr);
+  memset(ptr, 'A', 8 * 1024 * 1024);
+  GlobalAllocator::get_instance().dealloc(ptr);
+}